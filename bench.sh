@@ -0,0 +1,437 @@
+#!/bin/bash
+###############################################################################
+#
+# File:         bench.sh
+# Description:  Page layer benchmarks for the kernel memory allocator
+# Language:     bash
+#
+# Usage:        bash ./bench.sh <benchmark> [algorithm]
+#
+#   scale       replay traces whose working set grows from MAXPAGES to
+#               10 x MAXPAGES pages and report the cost per operation
+#   drain       repeatedly drain the pool to zero pages and refill it,
+#               comparing the POOLRETAIN idle-retention policies
+#   thp         replay testsuite/5.trace with and without a transparent
+#               huge page backed pool (POOLHUGE), best of 5 runs each
+#   prefault    replay testsuite/5.trace with and without pre-faulting
+#               8192 pages when the pool is set up (POOLPREFAULT) and
+#               report the start up time and page faults next to the time
+#               per op
+#   reuse       replay every trace in testsuite/ with each page reuse policy
+#               (POOLREUSE) and report the time per op, as a measure of
+#               cache behaviour, and how far into the pool the pages in use
+#               reach (peak and average span)
+#   persist     replay the first half of every trace in testsuite/ and time
+#               how long it takes to get that heap back in a new process,
+#               by replaying it again or by attaching a pool file it was
+#               saved to (kma_persist); the algorithm defaults to KMA_RM,
+#               KMA_BUD and KMA_P2FL
+#   cap         replay testsuite/5.trace with the pool capped at 1/2 and 1/4
+#               of its peak (the pageCap argument of the harness), and at 3,
+#               2 and 1 pages, where an allocator can't even set itself up,
+#               and report how often the shrinkers ran, the pages they gave
+#               back and the requests refused; fails if any run fails; the
+#               algorithm defaults to KMA_RM, KMA_BUD and KMA_P2FL
+#   threads     churn pages from 1 up to 2 x the number of CPUs threads
+#               (kma_scale) and report page operations per second
+#   pools       like threads, with every thread in a pool of its own
+#               (page_pool_create()) holding at most the pages it churns
+#   reserve     run the pool dry from 1 up to 2 x the number of CPUs threads,
+#               then time 16 atomic gets per thread served by the reserve
+#               (kma_scale); fails if any of them fails
+#   numa        churn pages with one thread per CPU pinned to it, on 1, 2
+#               and 4 emulated nodes (POOLNODES), taking pages from the
+#               thread's own node and from the next one (kma_scale)
+#   color       replay testsuite/5.trace with and without cache coloring of
+#               the in-page headers (PAGECOLORS), best of 5 runs each; the
+#               algorithm defaults to KMA_RM and KMA_BUD, which walk their
+#               page lists on every request
+#   zero        replay multi-page requests mixed with small ones, once over
+#               fresh memory and churned over the same pages, clearing the
+#               memory after kma_malloc and with kma_calloc (ZEROALLOC),
+#               which skips what is known to be zero; reports the best time
+#               per op and the pages handed out zeroed; the
+#               algorithm defaults to KMA_DUMMY, KMA_RM, KMA_BUD and KMA_P2FL
+#   latency     replay testsuite/5.trace timing every kma_malloc and kma_free
+#               with the cycle counter (LATENCY) and report p50, p99, p99.9
+#               and max per size class; the algorithm defaults to KMA_DUMMY,
+#               KMA_RM, KMA_BUD and KMA_P2FL
+#   compare     replay every trace in testsuite/ against several algorithms
+#               in one process (kma_bench), on the same decoded trace, and
+#               report the time per op, the pages in use and the pages the
+#               algorithm holds when the most requests are live; the
+#               algorithm defaults to KMA_DUMMY, KMA_RM, KMA_BUD and KMA_P2FL
+#   repeat      replay testsuite/5.trace 10 times after 2 warmup runs, pinned
+#               to CPU 0 with the pool at a fixed address, and report the
+#               mean, stddev and 95% confidence interval of the ops/sec and
+#               of the waste ratio, flagged if noisy; the algorithm defaults
+#               to KMA_DUMMY, KMA_RM, KMA_BUD and KMA_P2FL
+#   pagesize    replay every trace in testsuite/ with 4, 8 and 64 KB pages
+#               and report the time per op and the competition waste ratio;
+#               the algorithm defaults to KMA_RM, KMA_BUD and KMA_P2FL
+#
+# The algorithm defaults to KMA_DUMMY, which takes one page per request and
+# therefore stresses the page layer the most.
+#
+###############################################################################
+
+BENCH=$1
+ARGS=$2
+ALG=${2:-KMA_DUMMY}
+TMP=`mktemp -d /tmp/kma.bench.XXXXXX`
+
+function cleanUp()
+{
+	rm -Rf ${TMP};
+}
+
+function usage()
+{
+	echo "usage: $0 scale|drain|thp|prefault|reuse|persist|cap|threads|pools|reserve|numa|color|zero|latency|compare|repeat|pagesize [algorithm]";
+	cleanUp;
+	exit 1;
+}
+
+# build <algorithm> [name] [defines]: build the competition binary (no
+# correctness checks) for an algorithm with extra compiler defines
+function build()
+{
+	make -s competition COMPETITION=$1 DEFINES="$3" > /dev/null \
+		|| { cleanUp; exit 1; }
+	mv kma_competition ${TMP}/${2:-$1}
+}
+
+# gen_fill_trace <live> <rounds>: fill up to <live> outstanding requests,
+# free them all and repeat <rounds> times
+function gen_fill_trace()
+{
+	awk -v live=$1 -v rounds=$2 'BEGIN {
+		print live;
+		for (r = 0; r < rounds; r++) {
+			for (i = 0; i < live; i++) print "REQUEST", i, 4000;
+			for (i = 0; i < live; i++) print "FREE", i;
+		}
+	}'
+}
+
+# trace_ops <trace>: the number of operations in a trace, without the
+# number of requests on its first line
+function trace_ops()
+{
+	tail -n +2 $1 | grep -c .
+}
+
+# run <binary> <trace> <ops> [page size] [page cap]: print the replay time
+# and the time per op, as timed by the harness once the trace is loaded
+function run()
+{
+	$1 $2 $4 $5 > ${TMP}/out 2>&1 || { tail ${TMP}/out; cleanUp; exit 1; }
+	sed -n "s/^Replay Time: *\([0-9.]*\) ms.*/\1/p" ${TMP}/out \
+		| awk -v ops=$3 '{ printf "%d %d\n", $1, $1 * 1000000 / ops }'
+}
+
+# best <binary> <trace> <ops>: run 5 times, print the best time and time per op
+function best()
+{
+	BIN=$1; TRACE=$2; OPS=$3
+	BEST=-1
+	for RUN in 1 2 3 4 5; do
+		set -- `run ${BIN} ${TRACE} ${OPS}`
+		if [ ${BEST} -lt 0 -o $2 -lt ${BEST} ]; then
+			BEST=$2; BESTMS=$1
+		fi
+	done
+	echo "${BESTMS} ${BEST}"
+}
+
+function bench_scale()
+{
+	build ${ALG}
+	printf "%-8s %10s %10s %10s\n" "pages" "ops" "ms" "ns/op"
+	for LIVE in 4000 8000 20000 40000; do
+		# keep the number of operations constant across working sets
+		ROUNDS=$(( 400000 / (2 * LIVE) ))
+		OPS=$(( 2 * LIVE * ROUNDS ))
+		gen_fill_trace ${LIVE} ${ROUNDS} > ${TMP}/scale.trace
+		set -- `run ${TMP}/${ALG} ${TMP}/scale.trace ${OPS}`
+		printf "%-8d %10d %10d %10d\n" ${LIVE} ${OPS} $1 $2
+	done
+}
+
+function bench_drain()
+{
+	printf "%-12s %10s %10s %10s\n" "POOLRETAIN" "ops" "ms" "ns/op"
+	# a handful of pages drained a few thousand times
+	gen_fill_trace 16 10000 > ${TMP}/drain.trace
+	OPS=$(( 2 * 16 * 10000 ))
+	for RETAIN in 0 MAXPAGES -1; do
+		build ${ALG} retain "-DPOOLRETAIN=${RETAIN}"
+		set -- `run ${TMP}/retain ${TMP}/drain.trace ${OPS}`
+		printf "%-12s %10d %10d %10d\n" ${RETAIN} ${OPS} $1 $2
+	done
+}
+
+function bench_thp()
+{
+	TRACE=testsuite/5.trace
+	OPS=`trace_ops ${TRACE}`
+	printf "%-10s %10s %10s\n" "POOLHUGE" "best ms" "ns/op"
+	for HUGE in 0 1; do
+		build ${ALG} huge "-DPOOLHUGE=${HUGE}"
+		set -- `best ${TMP}/huge ${TRACE} ${OPS}`
+		printf "%-10s %10d %10d\n" ${HUGE} $1 $2
+	done
+	grep -o "\[.*\]" /sys/kernel/mm/transparent_hugepage/enabled \
+		| sed "s/^/transparent huge pages: /"
+}
+
+function bench_prefault()
+{
+	TRACE=testsuite/5.trace
+	OPS=`trace_ops ${TRACE}`
+	printf "%-12s %10s %12s %13s %10s\n" "POOLPREFAULT" "setup ms" \
+		"setup faults" "replay faults" "ns/op"
+	for PAGES in 0 8192; do
+		build ${ALG} prefault "-DPOOLPREFAULT=${PAGES}"
+		set -- `run ${TMP}/prefault ${TRACE} ${OPS}`
+		NSOP=$2
+		# the harness reports the faults of the first op, which sets up
+		# the pool, apart from those of the rest of the replay
+		set -- `sed -n "s/^Faults Setup\/Replay: *\([0-9]*\)\/ *\([0-9]*\) (setup \([0-9.]*\) ms)/\3 \1 \2/p" ${TMP}/out`
+		printf "%-12s %10s %12d %13d %10d\n" ${PAGES} $1 $2 $3 ${NSOP}
+	done
+}
+
+function bench_reuse()
+{
+	printf "%-8s %-8s %10s %10s %10s\n" "policy" "trace" "ns/op" \
+		"peak span" "avg span"
+	for POLICY in LIFO FIFO ADDRESS; do
+		build ${ALG} reuse "-DPOOLREUSE=REUSE_${POLICY}"
+		for TRACE in testsuite/*.trace; do
+			OPS=`trace_ops ${TRACE}`
+			set -- `run ${TMP}/reuse ${TRACE} ${OPS}`
+			NSOP=$2
+			set -- `sed -n "s/^Page Span Peak\/Average: *\([0-9]*\)\/ *\([0-9.]*\)/\1 \2/p" ${TMP}/out`
+			printf "%-8s %-8s %10d %10d %10s\n" ${POLICY} \
+				`basename ${TRACE}` ${NSOP} $1 $2
+		done
+	done
+}
+
+function bench_persist()
+{
+	printf "%-10s %-8s %10s %12s %12s\n" "algorithm" "trace" "ops" \
+		"rebuild ms" "attach ms"
+	for A in ${ARGS:-KMA_RM KMA_BUD KMA_P2FL}; do
+		make -s kma_persist COMPETITION=${A} > /dev/null \
+			|| { cleanUp; exit 1; }
+		for TRACE in testsuite/*.trace; do
+			OPS=$(( `trace_ops ${TRACE}` / 2 ))
+			./kma_persist rebuild ${TRACE} ${OPS} > ${TMP}/out \
+				|| { cleanUp; exit 1; }
+			REBUILD=`sed -n "s/^rebuild: .* in \(.*\) ms/\1/p" ${TMP}/out`
+			./kma_persist save ${TMP}/pool ${TRACE} ${OPS} > /dev/null \
+				&& ./kma_persist attach ${TMP}/pool ${TRACE} ${OPS} \
+				> ${TMP}/out || { cleanUp; exit 1; }
+			ATTACH=`sed -n "s/^attach: \(.*\) ms/\1/p" ${TMP}/out`
+			printf "%-10s %-8s %10d %12s %12s\n" ${A} \
+				`basename ${TRACE}` ${OPS} ${REBUILD} ${ATTACH}
+		done
+		rm -f kma_persist
+	done
+}
+
+function bench_cap()
+{
+	TRACE=testsuite/5.trace
+	OPS=`trace_ops ${TRACE}`
+	printf "%-10s %8s %10s %10s %10s %10s\n" "algorithm" "cap" "ns/op" \
+		"reclaims" "reclaimed" "refused"
+	for A in ${ARGS:-KMA_RM KMA_BUD KMA_P2FL}; do
+		build ${A}
+		set -- `run ${TMP}/${A} ${TRACE} ${OPS}`
+		PEAK=`sed -n "s/^Page Peak\/Average In Use: *\([0-9]*\)\/.*/\1/p" ${TMP}/out`
+		printf "%-10s %8s %10d %10d %10d %10d\n" ${A} none $2 0 0 0
+		for CAP in $(( PEAK / 2 )) $(( PEAK / 4 )) 3 2 1; do
+			set -- `run ${TMP}/${A} ${TRACE} ${OPS} 0 ${CAP}`
+			NSOP=$2
+			set -- `sed -n "s/^Page Reclaims\/Reclaimed\/Failed: *\([0-9]*\)\/ *\([0-9]*\)\/.*/\1 \2/p" ${TMP}/out` \
+				`sed -n "s/^Requests Refused (cap [0-9]*): *\([0-9]*\)/\1/p" ${TMP}/out`
+			printf "%-10s %8d %10d %10d %10d %10d\n" ${A} ${CAP} \
+				${NSOP} $1 $2 $3
+		done
+	done
+}
+
+function bench_threads()
+{
+	make -s kma_scale || { cleanUp; exit 1; }
+	MAX=$(( 2 * `nproc` ))
+	THREADS=1
+	while [ ${THREADS} -le ${MAX} ]; do
+		./kma_scale ${THREADS} 1000000 || { cleanUp; exit 1; }
+		THREADS=$(( THREADS * 2 ))
+	done
+	rm -f kma_scale
+}
+
+function bench_pools()
+{
+	make -s kma_scale || { cleanUp; exit 1; }
+	MAX=$(( 2 * `nproc` ))
+	THREADS=1
+	while [ ${THREADS} -le ${MAX} ]; do
+		./kma_scale ${THREADS} 1000000 pool || { cleanUp; exit 1; }
+		THREADS=$(( THREADS * 2 ))
+	done
+	rm -f kma_scale
+}
+
+function bench_reserve()
+{
+	make -s kma_scale || { cleanUp; exit 1; }
+	MAX=$(( 2 * `nproc` ))
+	THREADS=1
+	while [ ${THREADS} -le ${MAX} ]; do
+		./kma_scale ${THREADS} 1 reserve || { cleanUp; exit 1; }
+		THREADS=$(( THREADS * 2 ))
+	done
+	rm -f kma_scale
+}
+
+function bench_numa()
+{
+	THREADS=`nproc`
+	for NODES in 1 2 4; do
+		make -s kma_scale DEFINES="-DPOOLNODES=${NODES}" \
+			|| { cleanUp; exit 1; }
+		for MODE in local remote; do
+			echo "${NODES} nodes, ${MODE}:"
+			./kma_scale ${THREADS} 1000000 ${MODE} \
+				|| { cleanUp; exit 1; }
+		done
+		rm -f kma_scale
+	done
+}
+
+function bench_color()
+{
+	TRACE=testsuite/5.trace
+	OPS=`trace_ops ${TRACE}`
+	printf "%-10s %-10s %10s %10s\n" "algorithm" "PAGECOLORS" "best ms" "ns/op"
+	for A in ${ARGS:-KMA_RM KMA_BUD}; do
+		for COLORS in 1 8; do
+			build ${A} color "-DPAGECOLORS=${COLORS}"
+			set -- `best ${TMP}/color ${TRACE} ${OPS}`
+			printf "%-10s %-10s %10d %10d\n" ${A} ${COLORS} $1 $2
+		done
+	done
+}
+
+function bench_zero()
+{
+	# multi-page requests mixed with small ones: once over fresh memory,
+	# then churned over the same pages
+	for T in 4000:1 128:500; do
+		awk -v live=${T%:*} -v rounds=${T#*:} 'BEGIN {
+			print live;
+			for (r = 0; r < rounds; r++) {
+				for (i = 0; i < live; i++)
+					print "REQUEST", i, i % 2 ? 100 : 20000;
+				for (i = 0; i < live; i++) print "FREE", i;
+			}
+		}' > ${TMP}/${T}.trace
+	done
+	printf "%-10s %-10s %-8s %10s %12s\n" "algorithm" "ZEROALLOC" "trace" \
+		"ns/op" "zero pages"
+	for A in ${ARGS:-KMA_DUMMY KMA_RM KMA_BUD KMA_P2FL}; do
+		for ZERO in 0 1 2; do
+			build ${A} zero "-DZEROALLOC=${ZERO}"
+			for T in 4000:1 128:500; do
+				OPS=$(( 2 * ${T%:*} * ${T#*:} ))
+				set -- `best ${TMP}/zero ${TMP}/${T}.trace ${OPS}`
+				PAGES=`sed -n "s/^Page Zero\/Prezeroed: *\([0-9]*\)\/.*/\1/p" ${TMP}/out`
+				printf "%-10s %-10s %-8s %10d %12d\n" ${A} ${ZERO} \
+					${T#*:}x${T%:*} $2 ${PAGES}
+			done
+		done
+	done
+}
+
+function bench_latency()
+{
+	TRACE=testsuite/5.trace
+	OPS=`trace_ops ${TRACE}`
+	printf "%-10s %-10s %-6s %8s %8s %8s %8s %8s\n" "algorithm" "op" "size" \
+		"count" "p50 ns" "p99 ns" "p99.9 ns" "max ns"
+	for A in ${ARGS:-KMA_DUMMY KMA_RM KMA_BUD KMA_P2FL}; do
+		build ${A} latency "-DLATENCY=1"
+		run ${TMP}/latency ${TRACE} ${OPS} > /dev/null
+		sed -n "/^Latency (ns) op /d; s/^Latency (ns) /`printf '%-10s ' ${A}`/p" \
+			${TMP}/out
+	done
+}
+
+function bench_compare()
+{
+	make -s kma_bench || { cleanUp; exit 1; }
+	for TRACE in testsuite/*.trace; do
+		echo "`basename ${TRACE}`:"
+		./kma_bench ${TRACE} ${ARGS:-KMA_DUMMY KMA_RM KMA_BUD KMA_P2FL} \
+			|| { rm -f kma_bench; cleanUp; exit 1; }
+	done
+	rm -f kma_bench
+}
+
+function bench_repeat()
+{
+	TRACE=testsuite/5.trace
+	for A in ${ARGS:-KMA_DUMMY KMA_RM KMA_BUD KMA_P2FL}; do
+		build ${A}
+		${TMP}/${A} -w 2 -r 10 -c 0 -f ${TRACE} > ${TMP}/out 2>&1 \
+			|| { tail ${TMP}/out; cleanUp; exit 1; }
+		echo "${A}:"
+		sed -n "s/^\(Ops\/sec\|Waste ratio\) /  &/p" ${TMP}/out
+	done
+}
+
+function bench_pagesize()
+{
+	printf "%-10s %-8s %-8s %10s %10s\n" "algorithm" "trace" "pagesize" "ns/op" "ratio"
+	for A in ${ARGS:-KMA_RM KMA_BUD KMA_P2FL}; do
+		build ${A}
+		for TRACE in testsuite/*.trace; do
+			OPS=`trace_ops ${TRACE}`
+			for SIZE in 4096 8192 65536; do
+				set -- `run ${TMP}/${A} ${TRACE} ${OPS} ${SIZE}`
+				RATIO=`grep ratio ${TMP}/out | cut -d: -f2`
+				printf "%-10s %-8s %-8d %10d %10.3f\n" ${A} \
+					`basename ${TRACE}` ${SIZE} $2 ${RATIO}
+			done
+		done
+	done
+}
+
+case "${BENCH}" in
+	scale) bench_scale ;;
+	drain) bench_drain ;;
+	thp) bench_thp ;;
+	prefault) bench_prefault ;;
+	reuse) bench_reuse ;;
+	persist) bench_persist ;;
+	cap) bench_cap ;;
+	threads) bench_threads ;;
+	pools) bench_pools ;;
+	reserve) bench_reserve ;;
+	numa) bench_numa ;;
+	color) bench_color ;;
+	zero) bench_zero ;;
+	latency) bench_latency ;;
+	compare) bench_compare ;;
+	repeat) bench_repeat ;;
+	pagesize) bench_pagesize ;;
+	*) usage ;;
+esac
+
+cleanUp;
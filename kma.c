@@ -54,16 +54,28 @@
  ***************************************************************************/
 
 #define __KMA_TEST_IMPL__
+#define _GNU_SOURCE
 
 /************System include***********************************************/
 #include <assert.h>
+#include <limits.h>
+#include <math.h>
+#include <sched.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 /************Private include**********************************************/
 #include "kma_page.h"
 #include "kma.h"
+#include "kma_trace.h"
 
 /************Defines and Typedefs*****************************************/
 /*  #defines and typedefs should have their names in all caps.
@@ -82,23 +94,99 @@ typedef struct mem
 {
   int size;
   void* ptr;
-  void* value; // to check correctness
   enum REQ_STATE state;
 } mem_t;
 
+// correctness mode fills a request with a pattern instead of keeping a
+// copy of it: the 8 byte word k holds PATTERN(id) + k * PATTERNSTEP, so
+// every byte depends on the request and its offset; the pattern is
+// generated and checked PATTERNLANES words at a time
+#define PATTERN(id) (((uint64_t) (id) + 1) * 0x9e3779b97f4a7c15ULL)
+#define PATTERNSTEP 0xbf58476d1ce4e5b9ULL
+#define PATTERNLANES 4
+#define PATTERNBYTES (8 * PATTERNLANES)
+
+typedef uint64_t pattern_t __attribute__ ((vector_size (PATTERNBYTES)));
+
+// how requests are served: 0 by kma_malloc, 1 by kma_malloc followed by
+// clearing the memory, 2 by kma_calloc
+#ifndef ZEROALLOC
+#define ZEROALLOC 0
+#endif
+
+// time every kma_malloc and kma_free and report their latency percentiles
+// per size class
+#ifndef LATENCY
+#define LATENCY 0
+#endif
+
+// latency histograms split every power of two of cycles into 1 << SUBBITS
+// buckets, so a percentile is off by less than 1 / (1 << SUBBITS)
+#define SUBBITS 3
+#define BUCKETS ((64 - SUBBITS + 1) << SUBBITS)
+#define SIZECLASSES 5
+
+typedef struct
+{
+  long count;
+  unsigned long max;
+  long buckets[BUCKETS];
+} hist_t;
+
+// a repeated run is flagged as noisy if the 95% confidence interval of a
+// mean is wider than NOISELIMIT times the mean on either side
+#define NOISELIMIT 0.02
+#define STUDENTTDF 30
+#define Z95 1.96
+
+// the measured runs of a benchmark
+typedef struct
+{
+  int n;
+  double* opsPerSec;
+  double* ratio;
+} runs_t;
+
 /************Global Variables*********************************************/
 
-static int val = 0;
+// pages the pool is capped at, requests may be refused once it is reached
+static int pageCap = 0;
+static int refused = 0;
+// the decoded trace
+static kma_op_t* ops = NULL;
+// latency of kma_malloc [0] and kma_free [1] per size class
+static hist_t latency[2][SIZECLASSES];
+static const int kClassLimit[SIZECLASSES] = { 64, 512, 4096, 32768, INT_MAX };
+static const char* kClassName[SIZECLASSES] = { "<=64", "<=512", "<=4K",
+					       "<=32K", ">32K" };
+// Student's t for a 95% confidence interval, by degrees of freedom up to
+// STUDENTTDF
+static const double kStudentT[STUDENTTDF + 1] =
+  {
+    0,      12.706, 4.303,  3.182,  2.776,  2.571,  2.447,  2.365,
+    2.306,  2.262,  2.228,  2.201,  2.179,  2.160,  2.145,  2.131,
+    2.120,  2.110,  2.101,  2.093,  2.086,  2.080,  2.074,  2.069,
+    2.064,  2.060,  2.056,  2.052,  2.048,  2.045,  2.042
+  };
 
 /************Function Prototypes******************************************/
 void allocate();
 void deallocate();
-void fill(char*, int);
-void check(char*, char*, int);
+void fill(char*, int, uint64_t, uint64_t);
+void check(char*, int, uint64_t, uint64_t);
+void checkBytes(char*, int, int, uint64_t, uint64_t);
+char patternByte(int, uint64_t, uint64_t);
 void usage();
 void error(char*, char*);
 void pass();
 void fail();
+long faults();
+double now();
+unsigned long cycles();
+void record(int, int, unsigned long);
+unsigned long percentile(hist_t*, double);
+void report(double);
+void summarize(char*, double*, int, char*);
 
 /************External Declaration*****************************************/
 
@@ -128,6 +216,10 @@ main(int argc, char* argv[])
 
   int n_req = 0, n_alloc=0, n_dealloc=0;
   kma_page_stat_t* stat;
+  // a benchmark repeats the replay, after warmup runs that don't count
+  int warmup = 0, repeat = 1, cpu = -1, run, opt;
+  bool fixed = FALSE;
+  runs_t runs;
 
 #ifdef COMPETITION
   double ratioSum = 0.0;
@@ -143,79 +235,184 @@ main(int argc, char* argv[])
   fprintf(allocTrace, "0 0 0\n");
 #endif
 
-  if (argc != 2)
+  while ((opt = getopt(argc, argv, "w:r:c:f")) != -1)
+    {
+      switch (opt)
+	{
+	case 'w':
+	  warmup = atoi(optarg);
+	  break;
+	case 'r':
+	  repeat = atoi(optarg);
+	  break;
+	case 'c':
+	  cpu = atoi(optarg);
+	  break;
+	case 'f':
+	  fixed = TRUE;
+	  break;
+	default:
+	  usage();
+	}
+    }
+  argc -= optind - 1;
+  argv += optind - 1;
+  
+  if (argc < 2 || argc > 4 || warmup < 0 || repeat < 1)
     {
       usage();
     }
   
-  FILE* f_test = fopen(argv[1], "r");
-  if (f_test == NULL)
+#ifndef COMPETITION
+  // the checks and the allocation output file are for a single run
+  if (warmup + repeat > 1)
+    {
+      error("warmup and repeated runs need competition mode", "");
+    }
+#endif
+  
+  if (argc >= 3 && atoi(argv[2]) != 0 && !page_size(atoi(argv[2])))
+    {
+      error("unsupported page size", argv[2]);
+    }
+  
+  if (argc == 4)
     {
-      error("unable to open input test file", argv[1]);
+      pageCap = atoi(argv[3]);
+      if (pageCap < 1)
+	error("invalid page cap", argv[3]);
+      page_cap(pageCap);
     }
   
-  // Get the number of requests in the trace file
-  // Allocate some memory...
-  int status = fscanf(f_test, "%d\n", &n_req);
-  if(status != 1)
-    error("Couldn't read number of requests at head of file", "");
+  if (cpu >= 0)
+    {
+      cpu_set_t cpus;
+      
+      CPU_ZERO(&cpus);
+      CPU_SET(cpu, &cpus);
+      if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0)
+	error("unable to pin the replay to the CPU", "");
+    }
+  // without -f, whatever the build picked (POOLFIXED) holds
+  if (fixed)
+    {
+      page_fixed(TRUE);
+    }
+  
+  // Decode the whole trace before the replay, so that parsing it isn't
+  // timed along with the allocator
+  int n_ops;
+  ops = trace_load(argv[1], &n_req, &n_ops);
   
   mem_t* requests = malloc((n_req + 1)*sizeof(mem_t));
-  memset(requests, 0, (n_req + 1)*sizeof(mem_t));
   
-  char command[16];
-  int req_id, req_size, index = 1;
-
-  // Parse the lines in the file, and call allocate or
-  // deallocate accordingly.
-  while (fscanf(f_test, "%10s", command) == 1)
+  int i, req_id = 0, index = 1;
+  long setupFaults = 0, replayFaults = 0;
+  double setupTime = 0.0;
+  int spanPeak = 0;
+  double spanSum = 0.0;
+  double replayTime = 0.0;
+  unsigned long replayCycles = 0, paused, pausedCycles = 0;
+  
+  runs.n = 0;
+  runs.opsPerSec = malloc(repeat * sizeof(double));
+  runs.ratio = malloc(repeat * sizeof(double));
+  
+  for (run = 0; run < warmup + repeat; run++)
     {
-      if (strcmp(command, "REQUEST") == 0)
-	{
-	  
-	  if (fscanf(f_test, "%d %d", &req_id, &req_size) != 2)
-	    error("Not enough arguments to REQUEST", "");
-
-	  assert(req_id >= 0 && req_id < n_req);
-	  
-	  allocate(requests, req_id, req_size);
-	  n_alloc++;
-	}
-      else if (strcmp(command, "FREE") == 0)
+      memset(requests, 0, (n_req + 1)*sizeof(mem_t));
+      n_alloc = n_dealloc = 0;
+      index = 1;
+#ifdef COMPETITION
+      ratioSum = 0.0;
+      ratioCount = 0;
+#endif
+      if (run == warmup)
 	{
-	  if (fscanf(f_test, "%d", &req_id) != 1)
-	    error("Not enough arguments to FREE", "");
-	  
-	  assert(req_id >= 0 && req_id < n_req);
-	  
-	  deallocate(requests, req_id);
-	  n_dealloc++;
+	  // only the measured runs go into the histograms
+	  memset(latency, 0, sizeof(latency));
 	}
-      else
+
+      // the first operation sets up the page pool, so its page faults and
+      // time are the cost of starting up, what follows is the steady state
+      setupFaults = 0;
+      replayFaults = faults();
+      setupTime = now();
+      // how far into the pool the pages in use reach
+      spanPeak = 0;
+      spanSum = 0.0;
+
+      replayTime = now();
+      replayCycles = cycles();
+      pausedCycles = 0;
+
+      // Replay the operations, calling allocate or deallocate
+      // accordingly.
+      for (i = 0; i < n_ops; i++)
 	{
-	  error("unknown command type:", command);
-	}
+	  req_id = ops[i].id;
+	  if (ops[i].request)
+	    {
+	      allocate(requests, req_id, ops[i].size);
+	      n_alloc++;
+	    }
+	  else
+	    {
+	      deallocate(requests, req_id);
+	      n_dealloc++;
+	    }
+
+	  // sampling the page layer isn't part of the replay; it is timed
+	  // with the cycle counter alone, which is much cheaper to read than
+	  // the clock
+	  paused = cycles();
+
+	  stat = page_stats();
+	  int totalBytes = stat->num_in_use * stat->page_size;
+	  spanPeak = stat->num_span > spanPeak ? stat->num_span : spanPeak;
+	  spanSum += stat->num_span;
 
-      stat = page_stats();
-      int totalBytes = stat->num_in_use * stat->page_size;
 
-      
 #ifdef COMPETITION
-      if(req_id < n_req && n_alloc != n_dealloc)
-	{
-	  // We can calculate the ratio of wasted to used memory here.
-
-	  int wastedBytes = totalBytes - currentAllocBytes;
-	  ratioSum += ((double) wastedBytes) / currentAllocBytes;
-	  ratioCount += 1;
-	}
+	  if(req_id < n_req && n_alloc != n_dealloc)
+	    {
+	      // We can calculate the ratio of wasted to used memory here.
+
+	      int wastedBytes = totalBytes - currentAllocBytes;
+	      ratioSum += ((double) wastedBytes) / currentAllocBytes;
+	      ratioCount += 1;
+	    }
 #endif
 
 #ifndef COMPETITION
-      fprintf(allocTrace, "%d %d %d\n", index, currentAllocBytes, totalBytes);
+	  fprintf(allocTrace, "%d %d %d\n", index, currentAllocBytes, totalBytes);
 #endif
-      
-      index += 1;
+
+	  if (index == 1)
+	    {
+	      setupFaults = faults() - replayFaults;
+	      setupTime = now() - setupTime;
+	      replayFaults = faults();
+	    }
+
+	  index += 1;
+	  pausedCycles += cycles() - paused;
+	}
+      replayFaults = faults() - replayFaults;
+      replayTime = now() - replayTime;
+      replayCycles = cycles() - replayCycles;
+      // the time spent sampling is taken out in proportion to its cycles
+      replayTime *= (double) (replayCycles - pausedCycles) / replayCycles;
+      replayCycles -= pausedCycles;
+
+      if (run >= warmup)
+	{
+	  runs.opsPerSec[runs.n] = n_ops / replayTime;
+#ifdef COMPETITION
+	  runs.ratio[runs.n] = ratioSum / ratioCount;
+#endif
+	  runs.n++;
+	}
     }
 
 #ifndef COMPETITION
@@ -227,6 +424,38 @@ main(int argc, char* argv[])
   
   printf("Page Requested/Freed/In Use: %5d/%5d/%5d\n",
 	 stat->num_requested, stat->num_freed, stat->num_in_use);	
+  printf("Page Resident/Dirty/Purged:   %5d/%5d/%5d\n",
+	 stat->num_resident, stat->num_dirty, stat->num_purged);
+  printf("Page Peak/Average In Use:     %5d/%7.1f\n",
+	 stat->num_peak, stat->avg_in_use);
+  printf("Page Fresh/Reused:            %5d/%5d\n",
+	 stat->num_fresh, stat->num_reused);
+  printf("Page Span Peak/Average:       %5d/%7.1f\n",
+	 spanPeak, index > 1 ? spanSum / (index - 1) : 0.0);
+  printf("Page Prefaulted:              %5d\n", stat->num_prefaulted);
+  printf("Page Zero/Prezeroed:          %5d/%5d\n",
+	 stat->num_zero, stat->num_prezeroed);
+  printf("Page Reclaims/Reclaimed/Failed: %5d/%5d/%5d\n",
+	 stat->num_reclaims, stat->num_reclaimed, stat->num_failed);
+  if (pageCap > 0)
+    {
+      printf("Requests Refused (cap %d):     %5d\n", pageCap, refused);
+    }
+  printf("Replay Time:                  %9.3f ms (%d ops)\n",
+	 replayTime * 1000, n_ops);
+  printf("Faults Setup/Replay:          %5ld/%5ld (setup %.3f ms)\n",
+	 setupFaults, replayFaults, setupTime * 1000);
+  for (int tag = 0; tag < PAGETAGS; tag++)
+    {
+      if (stat->num_tag_gets[tag] > 0)
+	printf("Page Tag %2d Get/Free:         %5d/%5d\n", tag,
+	       stat->num_tag_gets[tag], stat->num_tag_frees[tag]);
+    }
+#if LATENCY
+  // the cycle counter is converted to ns at the rate it ran during the
+  // replay
+  report(replayCycles / (replayTime * 1e9));
+#endif
   
   if (stat->num_requested != stat->num_freed || stat->num_in_use != 0)
     {
@@ -240,6 +469,14 @@ main(int argc, char* argv[])
 
 #ifdef COMPETITION
   printf("Competition average ratio: %f\n", ratioSum / ratioCount);
+  if (runs.n > 1)
+    {
+      printf("Runs: %d measured after %d warmup, %s, %s\n", runs.n, warmup,
+	     cpu >= 0 ? "pinned" : "not pinned",
+	     fixed || POOLFIXED ? "fixed pool address" : "pool anywhere");
+      summarize("Ops/sec", runs.opsPerSec, runs.n, "%.0f");
+      summarize("Waste ratio", runs.ratio, runs.n, "%.6f");
+    }
 #endif
   
   pass();
@@ -260,9 +497,41 @@ pass()
   exit(0);
 }
 
+void
+summarize(char* what, double* x, int n, char* format)
+{
+  double mean = 0.0, var = 0.0, t, ci;
+  char line[128];
+  int i, df = n - 1;
+  
+  for (i = 0; i < n; i++)
+    {
+      mean += x[i] / n;
+    }
+  for (i = 0; i < n; i++)
+    {
+      var += (x[i] - mean) * (x[i] - mean) / (n - 1);
+    }
+  
+  // past the table, the first two terms of t's expansion around the
+  // normal's quantile are within 0.001 of it
+  if (df <= STUDENTTDF)
+    t = kStudentT[df];
+  else
+    t = Z95 + (pow(Z95, 3) + Z95) / (4 * df)
+      + (5 * pow(Z95, 5) + 16 * pow(Z95, 3) + 3 * Z95) / (96.0 * df * df);
+  ci = t * sqrt(var / n);
+  
+  snprintf(line, sizeof(line), "%%-12s mean %s, stddev %s, 95%%%% CI +/- %s%%s\n",
+	   format, format, format);
+  printf(line, what, mean, sqrt(var), ci,
+	 ci > NOISELIMIT * mean ? " (NOISY)" : "");
+}
+
 void
 usage() {
-  printf("Usage: %s traceFile\n", name);
+  printf("Usage: %s [-w warmup] [-r repeat] [-c cpu] [-f] traceFile "
+	 "[pageSize [pageCap]]\n", name);
   exit(0);
 }
 
@@ -272,6 +541,117 @@ error(char* message, char* arg ) {
   fail();
 }
 
+unsigned long
+cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+#endif
+}
+
+void
+record(int op, int size, unsigned long took)
+{
+  hist_t* hist;
+  int class, bucket, e;
+  
+  for (class = 0; size > kClassLimit[class]; class++)
+    ;
+  hist = &latency[op][class];
+  
+  // the first 1 << SUBBITS buckets hold a cycle count each, after that
+  // every power of two gets as many
+  if (took < (1 << SUBBITS))
+    {
+      bucket = took;
+    }
+  else
+    {
+      e = 63 - __builtin_clzl(took);
+      bucket = ((e - SUBBITS + 1) << SUBBITS)
+	+ ((took >> (e - SUBBITS)) & ((1 << SUBBITS) - 1));
+    }
+  
+  hist->buckets[bucket]++;
+  hist->count++;
+  hist->max = took > hist->max ? took : hist->max;
+}
+
+unsigned long
+percentile(hist_t* hist, double q)
+{
+  long rank = (long) (q * hist->count + 0.999999), seen = 0;
+  unsigned long high;
+  int bucket, e;
+  
+  for (bucket = 0; bucket < BUCKETS; bucket++)
+    {
+      seen += hist->buckets[bucket];
+      if (seen >= rank)
+	break;
+    }
+  
+  // the highest cycle count the bucket stands for
+  if (bucket < (1 << SUBBITS))
+    {
+      high = bucket;
+    }
+  else
+    {
+      e = (bucket >> SUBBITS) + SUBBITS - 1;
+      high = ((((1UL << SUBBITS) + (bucket & ((1 << SUBBITS) - 1)) + 1))
+	      << (e - SUBBITS)) - 1;
+    }
+  return high < hist->max ? high : hist->max;
+}
+
+void
+report(double perNs)
+{
+  char* opName[2] = { "kma_malloc", "kma_free" };
+  hist_t* hist;
+  int op, class;
+  
+  printf("Latency (ns) %-10s %-6s %8s %8s %8s %8s %8s\n", "op", "size",
+	 "count", "p50", "p99", "p99.9", "max");
+  for (op = 0; op < 2; op++)
+    {
+      for (class = 0; class < SIZECLASSES; class++)
+	{
+	  hist = &latency[op][class];
+	  if (hist->count == 0)
+	    continue;
+	  printf("Latency (ns) %-10s %-6s %8ld %8.0f %8.0f %8.0f %8.0f\n",
+		 opName[op], kClassName[class], hist->count,
+		 percentile(hist, 0.5) / perNs, percentile(hist, 0.99) / perNs,
+		 percentile(hist, 0.999) / perNs, hist->max / perNs);
+	}
+    }
+}
+
+long
+faults()
+{
+  struct rusage usage;
+  
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_minflt + usage.ru_majflt;
+}
+
+double
+now()
+{
+  struct timespec ts;
+  
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 void
 allocate(mem_t* requests, int req_id, int req_size)
 {
@@ -280,36 +660,52 @@ allocate(mem_t* requests, int req_id, int req_size)
   assert(new->state == FREE);
   
   new->size = req_size;
+#if LATENCY
+  unsigned long begin = cycles();
+#endif
+#if ZEROALLOC == 2
+  new->ptr = kma_calloc(new->size);
+#else
   new->ptr = kma_malloc(new->size);
+#endif
+#if LATENCY
+  record(0, new->size, cycles() - begin);
+#endif
   
-  // Accept a NULL response in some cases... 
-  if(!(((new->ptr != NULL) && (new->size <= (PAGESIZE - sizeof(void*))))
-       || ((new->ptr == NULL) && (new->size > (PAGESIZE - sizeof(void*))))))
+  // Accept a NULL response for requests that don't fit in a page,
+  // algorithms may serve them from contiguous pages but don't have to;
+  // with a page cap any request may be refused
+  if((new->ptr == NULL) && (new->size <= (PAGESIZE - sizeof(void*)))
+     && pageCap == 0)
     {
       error("got NULL from kma_malloc for alloc'able request", "");
     }
   
   if (new->ptr == NULL)
     {
+      refused++;
       return;
     }
 
+#if ZEROALLOC == 1
+  memset(new->ptr, 0, new->size);
+#endif
+
   currentAllocBytes += req_size;
   
 #ifndef COMPETITION
-  // Only run the actual memory accesses/copies/checks if we're
+  // Only run the actual memory accesses/checks if we're
   // testing for correctness.
   
-  new->value = malloc(new->size);
-  assert(new->value != NULL);
-  
+#if ZEROALLOC > 0
+  // the memory has to come cleared, a pattern of all zeroes
+  check((char*)new->ptr, new->size, 0, 0);
+#endif
+
   // initialize memory
-  fill((char*)new->ptr, new->size);
-  
-  // copy the value for further reference
-  bcopy(new->ptr, new->value, new->size);
+  fill((char*)new->ptr, new->size, PATTERN(req_id), PATTERNSTEP);
   
-  check((char*)new->ptr, (char*)new->value, new->size);
+  check((char*)new->ptr, new->size, PATTERN(req_id), PATTERNSTEP);
   
 #endif
 
@@ -321,6 +717,12 @@ deallocate(mem_t* requests, int req_id)
 {
   mem_t* cur = &requests[req_id];
   
+  if (cur->state == FREE && cur->ptr == NULL)
+    {
+      // kma_malloc refused this (large) request, nothing to free
+      return;
+    }
+  
   assert(cur->state == USED);
   assert(cur->size > 0);
   
@@ -328,13 +730,16 @@ deallocate(mem_t* requests, int req_id)
   // Only run the memory checks if we're testing for correctness.
 
   // check memory
-  check((char*)cur->ptr, (char*)cur->value, cur->size);
-
-  // free memory
-  free(cur->value);
+  check((char*)cur->ptr, cur->size, PATTERN(req_id), PATTERNSTEP);
 #endif
 
+#if LATENCY
+  unsigned long begin = cycles();
+#endif
   kma_free(cur->ptr, cur->size);
+#if LATENCY
+  record(1, cur->size, cycles() - begin);
+#endif
 
   currentAllocBytes -= cur->size;
   
@@ -342,28 +747,82 @@ deallocate(mem_t* requests, int req_id)
 }
 
 void
-fill(char* ptr, int size)
+fill(char* ptr, int size, uint64_t seed, uint64_t step)
 {
-  int i;
+  pattern_t words, inc;
+  int i, lane;
   
-  for (i = 0; i < size; i++)
+  for (lane = 0; lane < PATTERNLANES; lane++)
     {
-      ptr[i] = (char) val++;
+      words[lane] = seed + lane * step;
+      inc[lane] = PATTERNLANES * step;
     }
+  
+  // memcpy() lets the compiler use unaligned vector stores, the memory
+  // handed out need not be aligned
+  for (i = 0; i + PATTERNBYTES <= size; i += PATTERNBYTES)
+    {
+      memcpy(ptr + i, &words, PATTERNBYTES);
+      words += inc;
+    }
+  for (; i < size; i++)
+    {
+      ptr[i] = patternByte(i, seed, step);
+    }
+}
+
+void
+check(char* ptr, int size, uint64_t seed, uint64_t step)
+{
+  pattern_t words, inc, diff;
+  uint64_t any;
+  int i, lane;
+  
+  for (lane = 0; lane < PATTERNLANES; lane++)
+    {
+      words[lane] = seed + lane * step;
+      inc[lane] = PATTERNLANES * step;
+    }
+  
+  for (i = 0; i + PATTERNBYTES <= size; i += PATTERNBYTES)
+    {
+      memcpy(&diff, ptr + i, PATTERNBYTES);
+      diff ^= words;
+      for (any = 0, lane = 0; lane < PATTERNLANES; lane++)
+	any |= diff[lane];
+      // a mismatch is looked up byte by byte, to report each one
+      if (any != 0)
+	checkBytes(ptr, i, i + PATTERNBYTES, seed, step);
+      words += inc;
+    }
+  checkBytes(ptr, i, size, seed, step);
 }
 
 void
-check(char* lhs, char* rhs, int size)
+checkBytes(char* ptr, int from, int to, uint64_t seed, uint64_t step)
 {
+  char expected;
   int i;
   
-  for (i = 0; i < size; i++)
+  for (i = from; i < to; i++)
     {
-      if (lhs[i] != rhs[i])
+      expected = patternByte(i, seed, step);
+      if (ptr[i] != expected)
 	{
 	  fprintf(stderr, "memory mismatch at position %d (%3d!=%3d)\n", 
-		  i, lhs[i], rhs[i]);
+		  i, ptr[i], expected);
 	  anyMismatches = 1;
 	}
     }
 }
+
+char
+patternByte(int i, uint64_t seed, uint64_t step)
+{
+  uint64_t word = seed + (uint64_t) (i / 8) * step;
+  char bytes[8];
+  
+  // the byte as it lies in memory, whatever the byte order
+  memcpy(bytes, &word, 8);
+  return bytes[i % 8];
+}
@@ -74,8 +74,38 @@
 
 typedef int kma_size_t;
 
+// what an allocator reports about itself (kma_ops_t.stats)
+typedef struct
+{
+  int num_pages; // pages holding its blocks and tables
+  int num_spare; // empty pages it keeps for reuse, on top of num_pages
+} kma_stat_t;
+
+// an allocator, so that several of them can be built into one program
+// and picked at run time (kma_bench); every kma_*.c exports its own as
+// kma_<algorithm>_ops, next to the kma_malloc() family it provides when
+// it is the one built in. init, teardown and stats may be NULL
+typedef struct
+{
+  char* name;
+  void (*init)(void);              // before the first request
+  void* (*malloc)(kma_size_t);
+  void* (*calloc)(kma_size_t);
+  void (*free)(void*, kma_size_t);
+  void (*teardown)(void);          // once all requests were freed, gives
+                                   // back what is kept for reuse
+  void (*stats)(kma_stat_t*);
+} kma_ops_t;
+
 /************Global Variables*********************************************/
 
+extern kma_ops_t kma_dummy_ops;
+extern kma_ops_t kma_rm_ops;
+extern kma_ops_t kma_p2fl_ops;
+extern kma_ops_t kma_mck2_ops;
+extern kma_ops_t kma_bud_ops;
+extern kma_ops_t kma_lzbud_ops;
+
 /************Function Prototypes******************************************/
 
 /***********************************************************************
@@ -89,6 +119,17 @@ typedef int kma_size_t;
  ***********************************************************************/
 EXTERN void* kma_malloc(kma_size_t size);
 
+/***********************************************************************
+ *  Title: Allocates zeroed kernel memory
+ * ---------------------------------------------------------------------
+ *    Purpose: Like kma_malloc(), but the memory is cleared; memory the
+ *             allocator knows to be zero still, such as a page fresh
+ *             from the page layer, isn't cleared again
+ *    Input: the size
+ *    Output: the allocated memory, all zeroes, or NULL on failure
+ ***********************************************************************/
+EXTERN void* kma_calloc(kma_size_t size);
+
 /***********************************************************************
  *  Title: Frees kernel memory spaced
  * ---------------------------------------------------------------------
@@ -0,0 +1,253 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Replays one trace against several allocators in the same
+ *             process, picked at run time through their kma_ops_t
+ ***************************************************************************/
+
+/************************************************************************
+ Project Group: abg341, zta515
+
+ ***************************************************************************/
+
+/************System include***********************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+#include "kma_trace.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+#define ALGORITHMS 6
+
+typedef struct
+{
+  void* ptr;
+  int size;
+} mem_t;
+
+/************Global Variables*********************************************/
+static kma_ops_t* kAlgorithms[ALGORITHMS] =
+  {
+    &kma_dummy_ops, &kma_rm_ops, &kma_p2fl_ops, &kma_mck2_ops, &kma_bud_ops,
+    &kma_lzbud_ops
+  };
+
+static kma_op_t* ops = NULL;
+static int n_ops = 0;
+static int n_req = 0;
+// the operation after which the most requests are live
+static int peakOp = 0;
+
+/************Function Prototypes******************************************/
+kma_ops_t* lookup(char*);
+int findPeak();
+bool bench(kma_ops_t*);
+double now();
+void usage();
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+char *name = NULL;
+
+int
+main(int argc, char* argv[])
+{
+  bool ok = TRUE;
+  int i;
+
+  name = argv[0];
+
+  if (argc < 2)
+    {
+      usage();
+    }
+
+  for (i = 2; i < argc; i++)
+    {
+      lookup(argv[i]);
+    }
+
+  // the trace is decoded once, every allocator replays the same ops
+  ops = trace_load(argv[1], &n_req, &n_ops);
+  peakOp = findPeak();
+
+  printf("%-10s %10s %8s %8s %10s %12s %8s\n", "algorithm", "replay ms",
+	 "ns/op", "peak", "avg pages", "pages @ peak", "spare");
+  if (argc == 2)
+    {
+      for (i = 0; i < ALGORITHMS; i++)
+	ok = bench(kAlgorithms[i]) && ok;
+    }
+  for (i = 2; i < argc; i++)
+    {
+      ok = bench(lookup(argv[i])) && ok;
+    }
+
+  free(ops);
+  return ok ? 0 : 1;
+}
+
+kma_ops_t*
+lookup(char* algorithm)
+{
+  int i;
+
+  for (i = 0; i < ALGORITHMS; i++)
+    {
+      if (strcmp(kAlgorithms[i]->name, algorithm) == 0)
+	return kAlgorithms[i];
+    }
+
+  error("unknown algorithm", algorithm);
+  return NULL;
+}
+
+int
+findPeak()
+{
+  int i, live = 0, peak = 0, res = 0;
+
+  for (i = 0; i < n_ops; i++)
+    {
+      live += ops[i].request ? 1 : -1;
+      if (live > peak)
+	{
+	  peak = live;
+	  res = i;
+	}
+    }
+
+  return res;
+}
+
+bool
+bench(kma_ops_t* alg)
+{
+  mem_t* table = calloc(n_req, sizeof(mem_t));
+  kma_stat_t held = { 0, 0 };
+  kma_page_stat_t* stat;
+  mem_t* req;
+  double begin, elapsed, paused;
+  int i, failed = -1;
+
+  // every allocator runs on the default pool, with its per-thread page
+  // caches, like the kma_<algorithm> programs do; it starts from empty
+  // roots and statistics, and a pool the previous one gave back
+  memset(kma_page_roots, 0, PAGEROOTS * sizeof(void*));
+  if (!page_stats_reset())
+    {
+      error("pages still in use before", alg->name);
+    }
+  if (alg->init != NULL)
+    {
+      alg->init();
+    }
+
+  begin = now();
+  for (i = 0; i < n_ops; i++)
+    {
+      req = &table[ops[i].id];
+      if (ops[i].request)
+	{
+	  req->size = ops[i].size;
+	  req->ptr = alg->malloc(req->size);
+	  // only requests that fit in a page have to be served
+	  if (req->ptr == NULL && req->size <= PAGESIZE - sizeof(void*))
+	    {
+	      failed = i;
+	      break;
+	    }
+	}
+      else if (req->ptr != NULL)
+	{
+	  alg->free(req->ptr, req->size);
+	  req->ptr = NULL;
+	}
+
+      if (i == peakOp && alg->stats != NULL)
+	{
+	  // the walk over the allocator's pages isn't part of the replay
+	  paused = now();
+	  alg->stats(&held);
+	  begin += now() - paused;
+	}
+    }
+  elapsed = now() - begin;
+
+  // a replay cut short still has to give all of its memory back
+  for (i = 0; i < n_req; i++)
+    {
+      if (table[i].ptr != NULL)
+	alg->free(table[i].ptr, table[i].size);
+    }
+  free(table);
+  if (alg->teardown != NULL)
+    {
+      alg->teardown();
+    }
+
+  stat = page_stats();
+  if (failed >= 0)
+    {
+      printf("%-10s got NULL for an alloc'able request at op %d\n",
+	     alg->name, failed + 1);
+    }
+  else if (stat->num_in_use != 0)
+    {
+      printf("%-10s %d pages not freed\n", alg->name, stat->num_in_use);
+    }
+  else if (alg->stats == NULL)
+    {
+      printf("%-10s %10.3f %8.0f %8d %10.1f %12s %8s\n", alg->name,
+	     elapsed * 1000, elapsed * 1e9 / n_ops, stat->num_peak,
+	     stat->avg_in_use, "-", "-");
+    }
+  else
+    {
+      printf("%-10s %10.3f %8.0f %8d %10.1f %12d %8d\n", alg->name,
+	     elapsed * 1000, elapsed * 1e9 / n_ops, stat->num_peak,
+	     stat->avg_in_use, held.num_pages, held.num_spare);
+    }
+
+  if (stat->num_in_use == 0 && !page_release())
+    {
+      error("unable to release the page pool after", alg->name);
+    }
+  return failed < 0 && stat->num_in_use == 0;
+}
+
+double
+now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void
+usage()
+{
+  printf("Usage: %s traceFile [algorithm ...]\n", name);
+  exit(0);
+}
+
+void
+error(char* message, char* arg)
+{
+  fprintf(stderr, "ERROR: %s: %s.\n", message, arg);
+  exit(-1);
+}
@@ -38,7 +38,7 @@
  
  ***************************************************************************/
 
-#ifdef KMA_BUD
+#if defined(KMA_BUD) || defined(KMA_BENCH)
 #define __KMA_IMPL__
 
 /************System include***********************************************/
@@ -46,6 +46,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 
 /************Private include**********************************************/
 #include "kma_page.h"
@@ -59,35 +60,59 @@
  */
 
 #define MINBUFSIZE 32 
-#define NUMBERBUF PAGESIZE / MINBUFSIZE
-
+#define NUMBERBUF (PAGESIZE / MINBUFSIZE)
+
+// page slots linking the page list and flagging pages handed out whole;
+// they live in the page descriptor so that large pages are all payload
+#define PREVSLOT 0
+#define NEXTSLOT 1
+#define LARGESLOT 2
+#define NEXTPAGE(page) ((kma_page_t*)(page)->slot[NEXTSLOT])
+
+// page slot holding the offset from which the page was never written, if
+// it came zeroed from the page layer; buffers are taken leftmost first,
+// so it moves up slowly
+#define CLEANSLOT 3
+#define CLEAN(page) ((long) (page)->slot[CLEANSLOT])
+
+// the first page is kept among the roots of the page pool, so that it
+// comes back with a pool file
+#define FIRSTROOT 0
+#define FIRSTPAGE ((kma_page_t*) kma_page_roots[FIRSTROOT])
+
+// the tree has 2 * NUMBERBUF - 1 nodes, which depends on the page size
 typedef struct {
-  kma_page_t* next_page;
-  uint8_t large;
-  uint16_t length_longest[2 * NUMBERBUF - 1];
+  uint16_t length_longest[0];
 } page_header_t;
+#define HEADERSIZE ((2 * NUMBERBUF - 1) * sizeof(uint16_t))
+
+// the header sits at the page's color, everything before it is unused
+#define HEADER(page) ((page_header_t*)((page)->ptr + (page)->color))
+#define OCCUPIED(page) ((page)->color + HEADERSIZE)
 
 /************Global Variables*********************************************/
-kma_page_t* first_page = NULL;
 
 /************Function Prototypes******************************************/
-void init_header(kma_page_t*);
+static void init_header(kma_page_t*);
 
-kma_page_t* search_page(kma_size_t);
+static void* alloc_buffer(kma_size_t, bool);
 
-kma_page_t* next_free_page(void*);
+// clear a buffer handed out if asked to, and account for it being written
+static void write_buffer(kma_page_t*, kma_size_t, kma_size_t, bool);
 
-kma_size_t real_size(int, kma_size_t);
+static kma_page_t* search_page(kma_size_t);
 
-void delete_page(kma_page_t*);
+static kma_size_t real_size(kma_page_t*, int, kma_size_t);
 
-kma_size_t get_round(kma_size_t);
-int get_child_left(int);
-int get_child_right(int);
-int get_parent(int);
-int get_offset(int, kma_size_t);
-bool is_pow2(int);
-int max(int, int);
+static void delete_page(kma_page_t*);
+
+static kma_size_t get_round(kma_size_t);
+static int get_child_left(int);
+static int get_child_right(int);
+static int get_parent(int);
+static int get_offset(int, kma_size_t);
+static bool is_pow2(int);
+static int max(int, int);
 
   
 /************External Declaration*****************************************/
@@ -95,17 +120,16 @@ int max(int, int);
 /**************Implementation**********************************************/
 
 // initalize each pages header
-void init_header(kma_page_t* page){
+static void init_header(kma_page_t* page){
   page_header_t* page_header;
-  page_header = (page_header_t*)(page->ptr);
-  page_header->next_page = NULL;
-  page_header->large = 0;
+  page_header = HEADER(page);
 
   int real_length;
   kma_size_t i, node_size = 2 * PAGESIZE, offset, header_offset;
 
   // don't allocate page header 
-  header_offset = sizeof(page_header_t);
+  header_offset = OCCUPIED(page);
+  page->slot[CLEANSLOT] = (void*) (long) (page->zero ? header_offset : PAGESIZE);
 
   for (i = 0; i < 2 * NUMBERBUF - 1; i++){
     if (is_pow2(i + 1)) node_size = node_size / 2;
@@ -119,7 +143,15 @@ void init_header(kma_page_t* page){
   }
 }
 
-void* kma_malloc(kma_size_t size){
+static void* kma_bud_malloc(kma_size_t size){
+  return alloc_buffer(size, FALSE);
+}
+
+static void* kma_bud_calloc(kma_size_t size){
+  return alloc_buffer(size, TRUE);
+}
+
+static void* alloc_buffer(kma_size_t size, bool clear){
   if ((size + sizeof(kma_page_t*)) > PAGESIZE)
     return NULL;
 
@@ -135,11 +167,13 @@ void* kma_malloc(kma_size_t size){
   if (page == NULL)
     return NULL;
   else {
-    page_header = page->ptr;
-    if ((size + sizeof(page_header_t)) > PAGESIZE)
+    page_header = HEADER(page);
+    // only a fresh page can be too small, hand it out whole
+    if (page_header->length_longest[0] < size)
     {
-      page_header->large = 1;
-      return page->ptr + sizeof(kma_page_t*) + sizeof(uint8_t);
+      page->slot[LARGESLOT] = (void*) 1;
+      write_buffer(page, 0, size, clear);
+      return page->ptr;
     }
   }
 
@@ -169,18 +203,28 @@ void* kma_malloc(kma_size_t size){
     page_header->length_longest[index] = max(page_header->length_longest[get_child_left(index)], page_header->length_longest[get_child_right(index)]);
   }
 
+  write_buffer(page, offset, size, clear);
   return page->ptr + offset;
 }
 
-void kma_free(void* ptr, kma_size_t size){
-  kma_page_t* page = next_free_page(ptr);
-  page_header_t* page_header = page->ptr;
+static void write_buffer(kma_page_t* page, kma_size_t offset, kma_size_t size, bool clear){
+  // only what was written before needs clearing
+  if (clear && offset < CLEAN(page))
+    memset(page->ptr + offset, 0, offset + size < CLEAN(page) ? size : CLEAN(page) - offset);
+
+  if (offset + size > CLEAN(page))
+    page->slot[CLEANSLOT] = (void*) (long) (offset + size);
+}
+
+static void kma_bud_free(void* ptr, kma_size_t size){
+  kma_page_t* page = page_of(ptr);
+  page_header_t* page_header = HEADER(page);
   kma_size_t left_length, right_length;
   kma_size_t node_size;
   int index = 0;
   int offset;
 
-  if (page_header->large == 1){
+  if (page->slot[LARGESLOT] != NULL){
     delete_page(page);
     return;
   }
@@ -197,7 +241,7 @@ void kma_free(void* ptr, kma_size_t size){
     node_size = node_size * 2;
   }
 
-  page_header->length_longest[index] = (uint16_t)real_size(index, node_size);
+  page_header->length_longest[index] = (uint16_t)real_size(page, index, node_size);
 
   while (index){
     index = get_parent(index);
@@ -206,68 +250,58 @@ void kma_free(void* ptr, kma_size_t size){
     right_length = page_header->length_longest[get_child_right(index)];
 
     // check length for coalescing
-    if (left_length + right_length == real_size(index, node_size))
-      page_header->length_longest[index] = (uint16_t)real_size(index, node_size);
+    if (left_length + right_length == real_size(page, index, node_size))
+      page_header->length_longest[index] = (uint16_t)real_size(page, index, node_size);
     else
       page_header->length_longest[index] = max(left_length, right_length);
   }
 
-  if (page_header->length_longest[0] == (PAGESIZE - sizeof(page_header_t)))
+  if (page_header->length_longest[0] == (PAGESIZE - OCCUPIED(page)))
     delete_page(page);
 }
 
-kma_page_t* search_page(kma_size_t size)
+static kma_page_t* search_page(kma_size_t size)
 {
-  kma_page_t* page = first_page;
+  kma_page_t* page = FIRSTPAGE;
   page_header_t* page_header;
 
   // first page
   if (page == NULL){
     page = get_page();
+    if (page == NULL)
+      return NULL;
     init_header(page);
-    first_page = page;
+    kma_page_roots[FIRSTROOT] = page;
     return page;
   }
   else {
     while (page != NULL){
-      page_header = (page_header_t*)page->ptr;
+      page_header = HEADER(page);
 
-      if (page_header->large != 1 && page_header->length_longest[0] >= size)
+      if (page->slot[LARGESLOT] == NULL && page_header->length_longest[0] >= size)
         return page;
 
-      if (page_header->next_page == NULL){
-        page_header->next_page = get_page();
-        init_header(page_header->next_page);
-        return page_header->next_page;
+      if (NEXTPAGE(page) == NULL){
+        kma_page_t* next_page = get_page();
+        if (next_page == NULL)
+          return NULL;
+        page->slot[NEXTSLOT] = next_page;
+        init_header(NEXTPAGE(page));
+        NEXTPAGE(page)->slot[PREVSLOT] = page;
+        return NEXTPAGE(page);
       }
 
-      page = page_header->next_page;
+      page = NEXTPAGE(page);
     }
   }
   return NULL;
 }
 
-kma_page_t* next_free_page(void* ptr)
-{
-  kma_page_t* page = first_page;
-  page_header_t* page_header;
-  int offset;
-
-  while (page){
-    page_header = (page_header_t*)(page->ptr);
-    offset = ptr - page->ptr;
-    if (offset > 0 && offset < PAGESIZE)
-      return page;
-    page = page_header->next_page;
-  }
-  return NULL;
-}
-
-kma_size_t real_size(int index, kma_size_t node_size)
+static kma_size_t real_size(kma_page_t* page, int index, kma_size_t node_size)
 {
   kma_size_t size = node_size;
   int offset = get_offset(index, node_size);
-  int occupied_offset = sizeof(page_header_t);
+  int occupied_offset = OCCUPIED(page);
 
   if (occupied_offset >= offset){
     size = size - (occupied_offset - offset);
@@ -275,33 +309,28 @@ kma_size_t real_size(int index, kma_size_t node_size)
   return size;
 }
 
-void delete_page(kma_page_t* page)
+static void delete_page(kma_page_t* page)
 {
-  kma_page_t* current_page = first_page;
-  page_header_t* current_header = first_page->ptr;
+  kma_page_t* prev_page = page->slot[PREVSLOT];
+  kma_page_t* next_page = NEXTPAGE(page);
 
-  if (page->id == current_page->id){
-    first_page = current_header->next_page;
-    free_page(page);
-  }
-  else{
-    while (current_header->next_page){
-      if (current_header->next_page->id == page->id){
-        current_header->next_page = ((page_header_t*)(page->ptr))->next_page;
-        free_page(page);
-        break;
-      }
-      current_page = current_header->next_page;
-      current_header = (page_header_t*)(current_page->ptr);
-    }
-  }
+  // unlink the page from the doubly linked page list
+  if (prev_page == NULL)
+    kma_page_roots[FIRSTROOT] = next_page;
+  else
+    prev_page->slot[NEXTSLOT] = next_page;
+
+  if (next_page != NULL)
+    next_page->slot[PREVSLOT] = prev_page;
+
+  free_page(page);
 }
 
-int max(int x, int y){
+static int max(int x, int y){
   return x > y ? x : y;
 }
 
-kma_size_t get_round(kma_size_t size)
+static kma_size_t get_round(kma_size_t size)
 {
   size = size | (size >> 1);
   size = size | (size >> 2);
@@ -312,23 +341,52 @@ kma_size_t get_round(kma_size_t size)
   return size;
 }
 
-bool is_pow2(int x){
+static bool is_pow2(int x){
   return(!(x & (x - 1)));
 }
 
-int get_offset(int x, kma_size_t size){
+static int get_offset(int x, kma_size_t size){
   return ((x+1)*size-PAGESIZE);
 }
 
-int get_parent(int x){
+static int get_parent(int x){
   return ((x+1)/2-1);
 }
 
-int get_child_left(int x){
+static int get_child_left(int x){
   return (x*2+1);
 }
 
-int get_child_right(int x){
+static int get_child_right(int x){
   return (x*2+2);
 }
-#endif // KMA_BUD
\ No newline at end of file
+
+static void kma_bud_stats(kma_stat_t* stat){
+  kma_page_t* page;
+
+  stat->num_pages = 0;
+  stat->num_spare = 0;
+  for (page = FIRSTPAGE; page != NULL; page = NEXTPAGE(page))
+    stat->num_pages++;
+}
+
+kma_ops_t kma_bud_ops = {
+  "KMA_BUD", NULL, kma_bud_malloc, kma_bud_calloc, kma_bud_free, NULL,
+  kma_bud_stats
+};
+
+#ifdef KMA_BUD
+void* kma_malloc(kma_size_t size){
+  return kma_bud_malloc(size);
+}
+
+void* kma_calloc(kma_size_t size){
+  return kma_bud_calloc(size);
+}
+
+void kma_free(void* ptr, kma_size_t size){
+  kma_bud_free(ptr, size);
+}
+#endif
+
+#endif // KMA_BUD
@@ -41,12 +41,13 @@
  
  ***************************************************************************/
 
-#ifdef KMA_DUMMY
+#if defined(KMA_DUMMY) || defined(KMA_BENCH)
 #define __KMA_IMPL__
 
 /************System include***********************************************/
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 
 /************Private include**********************************************/
 #include "kma_page.h"
@@ -67,19 +68,15 @@
 
 /**************Implementation***********************************************/
 
-void* kma_malloc(kma_size_t size)
+static void* kma_dummy_malloc(kma_size_t size)
 {
   kma_page_t* page;
   
-  // get one page
-  page = get_page();
-  
-  // add a pointer to the page structure at the beginning of the page
-  *((kma_page_t**)page->ptr) = page;
+  // get one page, or a run of pages for large requests
+  page = get_pages(size <= PAGESIZE ? 1 : (size + PAGESIZE - 1) / PAGESIZE);
   
-  if ((size + sizeof(kma_page_t*)) > page->size)
+  if (page == NULL)
     { // requested size too large
-      free_page(page);
       return NULL;
     }
   
@@ -90,16 +87,52 @@ void* kma_malloc(kma_size_t size)
   //}
   // oh yea, it worked
   
-  return page->ptr + sizeof(kma_page_t*);
+  return page->ptr;
 }
 
-void kma_free(void* ptr, kma_size_t size)
+static void* kma_dummy_calloc(kma_size_t size)
+{
+  void* ptr = kma_dummy_malloc(size);
+  
+  // every request gets pages of its own, which may be fresh
+  if (ptr != NULL && !page_of(ptr)->zero)
+    {
+      memset(ptr, 0, size);
+    }
+  
+  return ptr;
+}
+
+static void kma_dummy_free(void* ptr, kma_size_t size)
 {
   kma_page_t* page;
   
-  page = *((kma_page_t**)(ptr - sizeof(kma_page_t*)));
+  page = page_of(ptr);
   
-  free_page(page);
+  free_pages(page);
+}
+
+kma_ops_t kma_dummy_ops =
+  {
+    "KMA_DUMMY", NULL, kma_dummy_malloc, kma_dummy_calloc, kma_dummy_free,
+    NULL, NULL
+  };
+
+#ifdef KMA_DUMMY
+void* kma_malloc(kma_size_t size)
+{
+  return kma_dummy_malloc(size);
+}
+
+void* kma_calloc(kma_size_t size)
+{
+  return kma_dummy_calloc(size);
+}
+
+void kma_free(void* ptr, kma_size_t size)
+{
+  kma_dummy_free(ptr, size);
 }
+#endif
 
 #endif // KMA_DUMMY
@@ -41,7 +41,7 @@
  
  ***************************************************************************/
  
-#ifdef KMA_LZBUD
+#if defined(KMA_LZBUD) || defined(KMA_BENCH)
 #define __KMA_IMPL__
 
 /************System include***********************************************/
@@ -67,14 +67,42 @@
 
 /**************Implementation***********************************************/
 
-void* kma_malloc(kma_size_t size)
+static void* kma_lzbud_malloc(kma_size_t size)
 {
   return NULL;
 }
 
-void kma_free(void* ptr, kma_size_t size)
+static void* kma_lzbud_calloc(kma_size_t size)
+{
+  return NULL;
+}
+
+static void kma_lzbud_free(void* ptr, kma_size_t size)
 {
   ;
 }
 
+kma_ops_t kma_lzbud_ops =
+  {
+    "KMA_LZBUD", NULL, kma_lzbud_malloc, kma_lzbud_calloc, kma_lzbud_free,
+    NULL, NULL
+  };
+
+#ifdef KMA_LZBUD
+void* kma_malloc(kma_size_t size)
+{
+  return kma_lzbud_malloc(size);
+}
+
+void* kma_calloc(kma_size_t size)
+{
+  return kma_lzbud_calloc(size);
+}
+
+void kma_free(void* ptr, kma_size_t size)
+{
+  kma_lzbud_free(ptr, size);
+}
+#endif
+
 #endif // KMA_LZBUD
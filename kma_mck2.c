@@ -42,7 +42,7 @@
  
  ***************************************************************************/
 
-#ifdef KMA_MCK2
+#if defined(KMA_MCK2) || defined(KMA_BENCH)
 #define __KMA_IMPL__
 
 /************System include***********************************************/
@@ -68,14 +68,42 @@
 
 /**************Implementation***********************************************/
 
-void* kma_malloc(kma_size_t size)
+static void* kma_mck2_malloc(kma_size_t size)
 {
   return NULL;
 }
 
-void kma_free(void* ptr, kma_size_t size)
+static void* kma_mck2_calloc(kma_size_t size)
+{
+  return NULL;
+}
+
+static void kma_mck2_free(void* ptr, kma_size_t size)
 {
   ;
 }
 
+kma_ops_t kma_mck2_ops =
+  {
+    "KMA_MCK2", NULL, kma_mck2_malloc, kma_mck2_calloc, kma_mck2_free,
+    NULL, NULL
+  };
+
+#ifdef KMA_MCK2
+void* kma_malloc(kma_size_t size)
+{
+  return kma_mck2_malloc(size);
+}
+
+void* kma_calloc(kma_size_t size)
+{
+  return kma_mck2_calloc(size);
+}
+
+void kma_free(void* ptr, kma_size_t size)
+{
+  kma_mck2_free(ptr, size);
+}
+#endif
+
 #endif // KMA_MCK2
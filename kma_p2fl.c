@@ -42,12 +42,14 @@
  
  ***************************************************************************/
 
-#ifdef KMA_P2FL
+#if defined(KMA_P2FL) || defined(KMA_BENCH)
 #define __KMA_IMPL__
 
 /************System include***********************************************/
 #include <assert.h>
+#include <limits.h>
 #include <stdlib.h>
+#include <string.h>
 
 /************Private include**********************************************/
 #include "kma_page.h"
@@ -60,58 +62,119 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+// page slot counting the blocks handed out from the page
+#define USEDSLOT 0
+#define USEDBLOCKS(page) ((long) (page)->slot[USEDSLOT])
+
+// page slot holding the offset of the first block never handed out, if
+// the page came zeroed from the page layer; the blocks of a new page are
+// handed out in address order, and only their headers were written
+#define CLEANSLOT 1
+#define CLEAN(page) ((long) (page)->slot[CLEANSLOT])
+
+// pages of a size class are accounted to their own tag, the level table
+// and whole page runs to tag 0
+#define CLASSTAG(size) (__builtin_ctz(size) - 3)
+
+// requests that don't fit the largest block get a run of whole pages
+#define WHOLEPAGES(size) ((size) + sizeof(blockT) > PAGESIZE)
+
 typedef struct block_t
 {
     kma_size_t size;
-    kma_page_t* page;
+    // free block: next free block, allocated block: its list header,
+    // list header: first free block
     struct block_t* header;
+    // list header: list of the next larger size
     struct block_t* upLevel;
+    // free block: previous free block or the list header, list header:
+    // start of a spare empty page of the size
+    struct block_t* prev;
 } blockT;
 
+// the table of free lists and the number of pages holding blocks are
+// kept among the roots of the page pool, so that they come back with a
+// pool file
+#define TABLEROOT 0
+#define COUNTROOT 1
+#define FLTABLE ((blockT*) kma_page_roots[TABLEROOT])
+#define PAGECOUNT ((long) kma_page_roots[COUNTROOT])
+
+// sizes 16 to the largest page size, each of which may keep a spare page
+#define MAXLEVELS (__builtin_ctz(MAXPAGESIZE) - 3)
+
 /************Global Variables*********************************************/
-static blockT* flTable = NULL;
-static int pageCount = 0;
 
 /************Function Prototypes******************************************/
 // returns block header of next order list of p2fl
-blockT* makeNewLevel(blockT*, int, int, kma_page_t*);
+static blockT* makeNewLevel(blockT*, int, void*);
 
 // returns free block from list
-blockT* getBlockFromList(kma_size_t, blockT*);
+static blockT* getBlockFromList(kma_size_t, blockT*);
+
+// removes a free block from its list
+static void unlinkBlock(blockT*);
+
+// takes up to the given number of spare pages off the table, returns
+// how many were stored
+static int takeSpares(int, kma_page_t**);
+
+// shrinker giving the spare pages back to the page layer
+static int releaseSpares(int);
+
+// kma_p2fl_malloc(), clearing the memory if asked to
+static void* allocBlock(kma_size_t, bool);
 
-// returns first block of next page
-blockT* getFirstAfterPage(blockT*, kma_page_t*);
 /************External Declaration*****************************************/
 
 /**************Implementation***********************************************/
 
-void* kma_malloc(kma_size_t size){
-    if (size > PAGESIZE)
-        return NULL;
+static void* kma_p2fl_malloc(kma_size_t size){
+    return allocBlock(size, FALSE);
+}
+
+static void* kma_p2fl_calloc(kma_size_t size){
+    return allocBlock(size, TRUE);
+}
+
+static void* allocBlock(kma_size_t size, bool clear){
+    if (WHOLEPAGES(size)){
+        kma_page_t* page = get_pages((size + PAGESIZE - 1) / PAGESIZE);
+        if (page == NULL)
+            return NULL;
+        if (clear && !page->zero)
+            memset(page->ptr, 0, size);
+        return page->ptr;
+    }
     else {
 
-        if(flTable == NULL){
-            // create first page and first block
+        if(FLTABLE == NULL){
+            // create first page and first block, at the page's color
             kma_page_t* page = get_page();
-            int nextLevelAddr = (int)page->ptr;
-            blockT* newLevel = (void*)nextLevelAddr;
+            if (page == NULL)
+                return NULL;
+            void* nextLevelAddr = page->ptr + page->color;
+            blockT* newLevel = nextLevelAddr;
 
             // make space for next buffer
             nextLevelAddr += sizeof(blockT);
-            newLevel->header = (void*)nextLevelAddr;
-            newLevel->page = page;
+            newLevel->header = nextLevelAddr;
             newLevel->size = 0;
 
             // add all levels to table of free lists
             int p2fLevel = 16;
-            flTable = newLevel;
+            kma_page_roots[TABLEROOT] = newLevel;
             while(p2fLevel <= PAGESIZE)
             {
                 nextLevelAddr += sizeof(blockT);
-                newLevel = makeNewLevel(newLevel, p2fLevel, nextLevelAddr, page);
+                newLevel = makeNewLevel(newLevel, p2fLevel, nextLevelAddr);
                 p2fLevel <<=  1;
             }
             newLevel->upLevel = NULL;
+
+            // the shrinker works on the roots of the pool it is registered
+            // with, it lives as long as this table
+            page_shrinker(releaseSpares);
         }
 
         // get rounded size necessary for incoming block
@@ -120,62 +183,91 @@ void* kma_malloc(kma_size_t size){
             rounded_size <<= 1;
 
         // find list header block corresponding to new rounded size
-        blockT* curBlock = flTable->upLevel;
+        blockT* curBlock = FLTABLE->upLevel;
         while(curBlock->size < rounded_size)
             curBlock = curBlock->upLevel;
 
         // remove first available block from free list and point that block's header back to the list
         blockT* freeBlock = getBlockFromList(rounded_size, curBlock);
-        curBlock->header = freeBlock->header;
+        if (freeBlock == NULL){
+            // a table without any page of blocks goes back right away
+            if (PAGECOUNT == 0){
+                free_page(page_of(FLTABLE));
+                kma_page_roots[TABLEROOT] = NULL;
+                page_shrinker_remove(releaseSpares);
+            }
+            return NULL;
+        }
+        unlinkBlock(freeBlock);
         freeBlock->header = curBlock;
+        kma_page_t* page = page_of(freeBlock);
+        page->slot[USEDSLOT] = (void*) (USEDBLOCKS(page) + 1);
+
+        // only a block handed out before needs clearing
+        long offset = (void*)freeBlock - page->ptr;
+        if (offset >= CLEAN(page))
+            page->slot[CLEANSLOT] = (void*) (offset + rounded_size);
+        else if (clear)
+            memset((void*)freeBlock + sizeof(blockT), 0, size);
         return ((void*)freeBlock + sizeof(blockT));
     }
 }
 
-blockT* makeNewLevel(blockT* newLevel, int levelSize, int addr, kma_page_t* page){
+static blockT* makeNewLevel(blockT* newLevel, int levelSize, void* addr){
     // set size pointer of input level to new address
-    newLevel->upLevel = (void*)addr;
+    newLevel->upLevel = addr;
     // make new level at that address
     newLevel = newLevel->upLevel;
     newLevel->header = NULL;
+    newLevel->prev = NULL;
     newLevel->size = levelSize;
-    newLevel->page = page;
     return newLevel;
 }
 
-blockT* getBlockFromList(kma_size_t size, blockT* listHeader){
+static blockT* getBlockFromList(kma_size_t size, blockT* listHeader){
     // check what listHeader is pointing to
     blockT* freeBlock = listHeader->header;
 
     // if listHeader pointer is null, we need to add page of blocks to list
     if (freeBlock == NULL){
 
-        // create new page for free list
-        kma_page_t* page = get_page();
-        pageCount++;
-        int nextBlockAddr = (int)page->ptr;
+        // create new page for free list, from the spare page if there is one
+        kma_page_t* page;
+        if (listHeader->prev != NULL){
+            page = page_of(listHeader->prev);
+            listHeader->prev = NULL;
+            page->slot[CLEANSLOT] = (void*) (long) PAGESIZE;
+        }
+        else {
+            page = get_page_tagged(CLASSTAG(size));
+            if (page == NULL)
+                return NULL;
+            page->slot[CLEANSLOT] = (void*) (long) (page->zero ? 0 : PAGESIZE);
+        }
+        kma_page_roots[COUNTROOT] = (void*) (PAGECOUNT + 1);
+        void* nextBlockAddr = page->ptr;
 
         // create first block of free list (this is what is returned)
-        blockT* curBlock = (void*)nextBlockAddr;
+        blockT* curBlock = nextBlockAddr;
         blockT* first = curBlock;
         curBlock->upLevel = NULL;
         curBlock->size = size;
-        curBlock->page = page;
+        curBlock->prev = listHeader;
         nextBlockAddr += size;
 
         // continue adding blocks to free list until we run out of space
         blockT* newBlock;
-        while((nextBlockAddr - (int)page->ptr) < PAGESIZE)
+        while((nextBlockAddr - page->ptr) < PAGESIZE)
         {
-            newBlock = (void*)nextBlockAddr;
+            newBlock = nextBlockAddr;
 
             // header should store pointer to next free buffer
             curBlock->header = newBlock;
+            newBlock->prev = curBlock;
             curBlock = newBlock;
             nextBlockAddr += size;
             newBlock->upLevel = NULL;
             newBlock->size = size;
-            newBlock->page = page;
         }
 
         curBlock->header = NULL;
@@ -187,8 +279,18 @@ blockT* getBlockFromList(kma_size_t size, blockT* listHeader){
 
 }
 
-void kma_free(void* ptr, kma_size_t size)
+static void unlinkBlock(blockT* block){
+    block->prev->header = block->header;
+    if (block->header != NULL)
+        block->header->prev = block->prev;
+}
+
+static void kma_p2fl_free(void* ptr, kma_size_t size)
 {
+    if (WHOLEPAGES(size)){
+        free_pages(page_of(ptr));
+        return;
+    }
 
     // get block and corresponding list
     blockT* blockToFree = (blockT*)(ptr - sizeof(blockT));
@@ -196,57 +298,104 @@ void kma_free(void* ptr, kma_size_t size)
 
     // insert block at front of free list
     blockToFree->header = fromList->header;
+    blockToFree->prev = fromList;
+    if (fromList->header != NULL)
+        fromList->header->prev = blockToFree;
     fromList->header = blockToFree;
 
-    // accumulate total amount of free space on block's page in list
-    blockT* curBlock = blockToFree;
-    kma_page_t* page = blockToFree->page;
-    kma_size_t memOnPage = 0;
-    while(curBlock != NULL)
-    {
-        if(curBlock->page == page)
-            memOnPage += curBlock->size;
-        curBlock = curBlock->header;
-    }
-
     // if the page is full of free blocks, we should remove it
-    if (memOnPage >= PAGESIZE){
-        blockT* previous = fromList;
-        blockT* current = previous->header;
-        while(current){
-            // iterate until finding blocks on page (may not be in one contiguous chain)
-            if(current->page != page){
-                previous = current;
-                current = current->header;
-            }
-            else{
-                // remove block from free list
-                current = getFirstAfterPage(current, page);
-                previous->header = current;
-
-                // if still more blocks on list, keep going
-                if (current){
-                    previous = current;
-                    current = current->header;
-                }
-            }
+    kma_page_t* page = page_of(blockToFree);
+    page->slot[USEDSLOT] = (void*) (USEDBLOCKS(page) - 1);
+    if (USEDBLOCKS(page) == 0){
+        // the lists are doubly linked, so only the page's own blocks
+        // need to be visited
+        void* blockAddr;
+        for (blockAddr = page->ptr; blockAddr < page->ptr + PAGESIZE; blockAddr += fromList->size)
+            unlinkBlock(blockAddr);
+
+        kma_page_roots[COUNTROOT] = (void*) (PAGECOUNT - 1);
+
+        // if no pages used in size table, free size table along with it
+        // and the spares, all in one go
+        if(PAGECOUNT == 0){
+            kma_page_t* pages[MAXLEVELS + 2];
+            int n = takeSpares(MAXLEVELS, pages);
+            pages[n++] = page;
+            pages[n++] = page_of(FLTABLE);
+            free_pages_bulk(n, pages);
+            kma_page_roots[TABLEROOT] = NULL;
+            page_shrinker_remove(releaseSpares);
         }
-        free_page(page);
-        pageCount--;
+        // keep one empty page per size, so that a size that keeps filling
+        // and emptying a page doesn't go to the page layer every time
+        else if (fromList->prev == NULL){
+            fromList->prev = page->ptr;
+        }
+        else
+            free_page(page);
     }
+}
+
+static int takeSpares(int max, kma_page_t** out){
+    int n = 0;
 
-    // if no pages used in size table, free size table
-    if(pageCount == 0){
-        free_page(flTable->page);
-        flTable = NULL;
+    if (FLTABLE == NULL)
+        return 0;
+
+    blockT* level;
+    for (level = FLTABLE->upLevel; level != NULL && n < max; level = level->upLevel)
+    {
+        if (level->prev != NULL){
+            out[n++] = page_of(level->prev);
+            level->prev = NULL;
+        }
     }
+    return n;
 }
 
-blockT* getFirstAfterPage(blockT* curBlock, kma_page_t* page){
-    while (curBlock != NULL && curBlock->page == page)
-        curBlock = curBlock->header;
-    return curBlock;
+static int releaseSpares(int pages){
+    kma_page_t* spares[MAXLEVELS];
+    int freed = takeSpares(pages < MAXLEVELS ? pages : MAXLEVELS, spares);
+
+    free_pages_bulk(freed, spares);
+    return freed;
 }
 
-#endif // KMA_P2FL
+static void kma_p2fl_teardown(void){
+    releaseSpares(INT_MAX);
+}
 
+static void kma_p2fl_stats(kma_stat_t* stat){
+    stat->num_pages = 0;
+    stat->num_spare = 0;
+    if (FLTABLE == NULL)
+        return;
+
+    // the pages holding blocks, and the one holding the table
+    stat->num_pages = PAGECOUNT + 1;
+    blockT* level;
+    for (level = FLTABLE->upLevel; level != NULL; level = level->upLevel)
+        if (level->prev != NULL)
+            stat->num_spare++;
+}
+
+kma_ops_t kma_p2fl_ops = {
+    "KMA_P2FL", NULL, kma_p2fl_malloc, kma_p2fl_calloc, kma_p2fl_free,
+    kma_p2fl_teardown, kma_p2fl_stats
+};
+
+#ifdef KMA_P2FL
+void* kma_malloc(kma_size_t size){
+    return kma_p2fl_malloc(size);
+}
+
+void* kma_calloc(kma_size_t size){
+    return kma_p2fl_calloc(size);
+}
+
+void kma_free(void* ptr, kma_size_t size){
+    kma_p2fl_free(ptr, size);
+}
+#endif
+
+#endif // KMA_P2FL
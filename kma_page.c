@@ -48,6 +48,7 @@
  ***************************************************************************/
 
  #define __KPAGE_IMPL__
+#define _GNU_SOURCE
 
 /************System include***********************************************/
 #include <assert.h>
@@ -55,6 +56,14 @@
 #include <string.h>
 #include <strings.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/syscall.h>
 
 /************Private include**********************************************/
 #include "kma_page.h"
@@ -67,16 +76,311 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+// page operations between two reads of the decay clock
+#define DECAYTICK 64
+
+// single pages a thread caches before it gives half of them back
+#define MAGSIZE 32
+
+// pages a thread's count of pages in use may drift from the shared one
+// before it is added to it; keeps the peak and average exact for a single
+// thread without an atomic operation per page
+#define INUSEBATCH 64
+
+// the counters of a thread's cache are only written by that thread, but
+// page_stats() reads them from any thread without its lock; relaxed
+// atomics make that race free and cost no more than plain loads and stores
+#define COUNT(field, n) \
+  __atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+#define PEEK(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+// largest run is 2^MAXORDER pages; keep in sync with MAXPAGES so that no
+// run ever straddles a chunk boundary
+#define MAXORDER 12
+
+// levels of the bitmap of free single pages the ADDRESS policy searches:
+// a bit per page, a bit per word of the level below, and so on; a word
+// of the middle level covers MAXPAGES pages, so partitions start on a bit
+// of the top level
+#define MAPSHIFT 6
+#define MAPLEVEL1 (POOLPAGES >> MAPSHIFT)
+#define MAPLEVEL2 (MAPLEVEL1 >> MAPSHIFT)
+#define MAPLEVEL3 ((MAPLEVEL2 + 63) >> MAPSHIFT)
+
+// the span counts followed by the levels of the bitmap
+#define TABLESIZE (POOLPAGES / SPANPAGES * sizeof(int) \
+		   + (MAPLEVEL1 + MAPLEVEL2 + MAPLEVEL3) * sizeof(uint64_t))
+
+// layout of a pool file: the superblock, the frame table and the tables
+// above, each rounded up to MAXPAGESIZE so that the pool behind them is
+// aligned to its pages, and the pool itself
+#define FILEALIGN(x) (((size_t) (x) + MAXPAGESIZE - 1) \
+		      & ~((size_t) MAXPAGESIZE - 1))
+#define FRAMEOFFSET FILEALIGN(sizeof(kma_super_t))
+#define TABLEOFFSET (FRAMEOFFSET + FILEALIGN(POOLPAGES * sizeof(kma_frame_t)))
+#define POOLOFFSET (TABLEOFFSET + FILEALIGN(TABLESIZE))
+#define FILESIZE (POOLOFFSET + (size_t) POOLPAGES * PAGESIZE)
+#define SUPERMAGIC "KMAPOOL"
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+// memory policy for mbind(), numaif.h isn't necessarily around
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+// whether purged pages read back as zeroes; MADV_FREE may leave them as
+// they were if the system didn't need the memory
+#ifdef KMA_PURGE_LAZY
+#define PURGEADVICE MADV_FREE
+#define PURGEDZERO FALSE
+#else
+#define PURGEADVICE MADV_DONTNEED
+#define PURGEDZERO TRUE
+#endif
+
+enum FRAME_STATE
+  {
+    UNUSED, // never handed out, or given back to the system
+    INUSE,
+    DIRTY,  // free, but still resident
+    PURGED, // free and returned to the system
+    HELD    // free, on the free list of a kma_pool_t or in the reserve
+  };
+
+// per page bookkeeping, kept outside of the pages so that their contents
+// can be discarded while they are free; for a run of pages only the frame
+// of its first page is kept up to date, and only the first page of an
+// allocated run is INUSE
+typedef struct frame
+{
+  kma_page_t page; // the descriptor handed out for the page
+  enum FRAME_STATE state;
+  int order;     // the run covers 2^order pages
+  struct frame* next;
+  struct frame* prev;
+  long freed_op; // decay clock when the page was last freed
+  long freed_ms;
+  bool fresh;    // not resident since it was taken from the depot
+  int tag;       // caller tag of an allocated run
+  bool zero;     // all zeroes; only kept for free pages and runs
+  struct kma_pool* owner; // pool the run was got from, NULL for the default
+} kma_frame_t;
+
+// per thread cache of free single pages, so that the common get and free
+// paths don't have to take the pool lock
+typedef struct cache
+{
+  kma_frame_t* mag[MAGSIZE];
+  int count;
+  int color; // color of the next page handed out
+  kma_page_stat_t stats; // this thread's share of the page statistics
+  long ops;        // page operations of this thread
+  long in_use_sum; // pages in use summed over those operations
+  int in_use_delta; // pages in use not yet added to pool_in_use
+  struct cache* next;
+} kma_cache_t;
+
+// a partition of the pool, one per (emulated) NUMA node; it has its own
+// free lists and frontier, and the pages freed to it always come back to
+// it, whichever node the freeing thread runs on
+typedef struct node
+{
+  // free single pages that are still resident, most recently freed first
+  kma_frame_t* dirty_head;
+  kma_frame_t* dirty_tail;
+  // free single pages that have been purged, most recently purged first
+  kma_frame_t* purged_head;
+  // free runs of 2^order pages, aligned to their size
+  kma_frame_t* free_runs[MAXORDER + 1];
+  // first page of the partition; pages from there to the frontier have
+  // been handed out at least once, pages up to committed are accessible
+  int base;
+  int frontier;
+  int committed;
+  // end of the last group of SPANPAGES pages with pages out of the depot
+  int top;
+  kma_node_stat_t stats;
+} kma_node_t;
+
+// a tenant of the depot; the pages it holds count as out of the depot,
+// its lock is taken before pool_lock, never after it
+struct kma_pool
+{
+  pthread_mutex_t lock;
+  int quota;
+  int out; // pages held, in use or on the free list
+  // free single pages, most recently freed first
+  kma_frame_t* free;
+  int n_free;
+  kma_page_stat_t stats;
+  long ops;
+  long in_use_sum;
+  void* roots[PAGEROOTS];
+  // the shrinkers registered from within the pool, which work on its roots
+  kma_shrinker_t shrinkers[PAGESHRINKERS];
+  int n_shrinkers;
+};
+
+// first block of a pool file; everything else in the file is only valid
+// if the pool was detached cleanly, the pointers in there assume that the
+// file is mapped at the same address again
+typedef struct
+{
+  char magic[8];
+  bool clean;
+  void* address;
+  // the layout of the file
+  int page_shift;
+  int pages;
+  int frame_size;
+  // the depot
+  int nodes;
+  int node_pages;
+  bool numa;
+  int reuse;
+  int out;
+  int in_use;
+  long ops;
+  long in_use_sum;
+  long clock;
+  kma_page_stat_t stats;
+  kma_node_t node[MAXNODES];
+  void* roots[PAGEROOTS];
+} kma_super_t;
+
 /************Global Variables*********************************************/
-static kma_page_stat_t kma_page_stats = { 0, 0, 0, PAGESIZE };
+#if PAGESIZEFIXED
+int kma_page_shift = PAGESHIFT;
+#else
+int kma_page_shift = __builtin_ctz(POOLPAGESIZE);
+#endif
+// the default pool's roots, those saved with a pool file
+static void* pool_roots[PAGEROOTS];
+__thread void** kma_page_roots = pool_roots;
+
+// everything below is the shared depot and is protected by pool_lock,
+// except for the per thread caches
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static kma_page_stat_t kma_page_stats = { 0 };
+// pages in use right now, up to the drift in the thread caches; kept with
+// atomics rather than under pool_lock like the peak; and the page
+// operations of threads that are gone
+static int pool_in_use = 0;
+static long pool_ops = 0;
+static long pool_in_use_sum = 0;
 
 static void* pool = NULL;
-static void* next_free_page = NULL;
+static kma_frame_t* frames = NULL;
+// the file backing the pool, its superblock and whether the pool was
+// attached from it rather than created
+static int pool_fd = -1;
+static kma_super_t* pool_super = NULL;
+static bool pool_attached = FALSE;
+// pages out of the depot per group of SPANPAGES pages
+static int* spans = NULL;
+// free single pages by address, only kept for the ADDRESS policy
+static uint64_t* free_map[3];
+// the partitions of the pool, pool_node_pages pages each
+static kma_node_t nodes[MAXNODES];
+static int pool_nodes = 1;
+static int pool_node_pages = POOLPAGES;
+// nodes to split the pool into when it is set up, 0 for the machine's
+static int pool_want_nodes = POOLNODES;
+// whether the partitions are the machine's nodes rather than emulated
+static bool pool_numa = FALSE;
+// number of pages out of the depot, in use or sitting in a thread cache
+static int pool_out = 0;
+// pages that may be out of the depot, 0 for no limit
+static int pool_cap = POOLCAP;
+// pages set aside for atomic gets, linked through next; they count as out
+// of the depot for the cap, but not in pool_out, so that they don't keep
+// the pool from going idle
+static int pool_reserve = POOLRESERVE;
+static int pool_reserved = 0;
+static kma_frame_t* pool_reserve_head = NULL;
+// the shrinkers of the default pool's allocators, run when it runs out
+static kma_shrinker_t pool_shrinkers[PAGESHRINKERS];
+static int pool_n_shrinkers = 0;
+// pages kept committed while the pool is idle
+static int pool_retain = POOLRETAIN;
+// which free page is handed out next
+static int pool_reuse = POOLREUSE;
+// pages pre-faulted when the pool is set up, 0 to fault them on first use
+static int pool_prefault = POOLPREFAULT;
+// whether the pool is backed by transparent huge pages
+static int pool_huge = -1;
+// whether an anonymous pool is mapped at POOLADDRESS
+static int pool_fixed = POOLFIXED;
+// how long dirty pages linger before they are purged
+static long pool_decay_ops = POOLDECAYOPS;
+static long pool_decay_ms = POOLDECAYMS;
+// decay clock, in page operations and in milliseconds
+static long pool_clock = 0;
+static long pool_now = 0;
+
+// the caches of all live threads
+static kma_cache_t* caches = NULL;
+static int pool_threads = 0;
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static __thread kma_cache_t* cache = NULL;
+// the pool the thread entered, NULL for the default one
+static __thread kma_pool_t* current_pool = NULL;
 
 /************Function Prototypes******************************************/
-void* allocPage();
-void freePage(void*);
+kma_page_t* getPages(int, int, int);
+kma_frame_t* depotFrames(kma_cache_t*, int, int, bool);
+void reclaimPages(kma_cache_t*, kma_pool_t*, kma_page_stat_t*, int);
+kma_page_t* poolPages(kma_pool_t*, int, int, int);
+kma_frame_t* poolDepot(kma_pool_t*, kma_cache_t*, int, int);
+void poolFree(kma_frame_t*);
+void flushPool(kma_pool_t*);
+void returnFrames(kma_frame_t*);
+void fillReserve();
+void drainReserve(int);
+kma_frame_t* takeFrames(int, int);
+kma_frame_t* allocFrames(kma_node_t*, int);
+void freeFrames(kma_frame_t*);
+void pushFrames(kma_frame_t*, int, enum FRAME_STATE);
+void unlinkRun(kma_frame_t*);
+void unlinkPage(kma_frame_t*);
+void spanPages(kma_node_t*, int, int, int);
+void markFree(int, bool);
+int lowestFree(kma_node_t*);
+void purgeRun(kma_frame_t*);
 void initPages();
+void mapAnonymous();
+void mapFile();
+bool attachPool();
+void detachPool();
+void unmapPool();
+bool growPages(kma_node_t*);
+void idlePages();
+void idleNode(kma_node_t*, int);
+void releasePages();
+void tickPages();
+void decayPages(bool);
+void decayNode(kma_node_t*, bool);
+kma_node_t* nodeOf(kma_frame_t*);
+int currentNode();
+int machineNodes();
+void purgeRange(int, int);
+void prefaultRange(void*, size_t);
+long nowMs();
+int hugeAvailable();
+kma_cache_t* getCache();
+void flushCache(kma_cache_t*, int);
+void idleCache(kma_cache_t*);
+kma_page_t* initPage(kma_cache_t*, kma_page_stat_t*, kma_frame_t*, int);
+void countPages(kma_cache_t*, int);
+void addStats(kma_page_stat_t*, kma_page_stat_t*);
+void foldCache(kma_cache_t*);
+void createCacheKey();
+void retireCache(void*);
 
 /************External Declaration*****************************************/
 
@@ -85,106 +389,2316 @@ void initPages();
 kma_page_t*
 get_page()
 {
-  static int id = 0;
-  kma_page_t* res;
+  return get_pages_tagged(1, 0);
+}
+
+kma_page_t*
+get_page_tagged(int tag)
+{
+  return get_pages_tagged(1, tag);
+}
+
+void
+free_page(kma_page_t* ptr)
+{
+  kma_cache_t* c = getCache();
+  kma_frame_t* frame;
+  int pages;
+  
+  assert(ptr != NULL);
+  assert(ptr->ptr != NULL);
+  assert(ptr->ptr == BASEADDR(ptr->ptr));
+  
+  frame = (kma_frame_t*) ptr;
+  assert(frame == &frames[(ptr->ptr - pool) >> PAGESHIFT]);
+  assert(frame->state == INUSE);
+  
+  if (frame->owner != NULL)
+    {
+      poolFree(frame);
+      return;
+    }
   
-  kma_page_stats.num_requested++;
-  kma_page_stats.num_in_use++;
+  pages = 1 << frame->order;
+  COUNT(c->stats.num_freed, pages);
+  COUNT(c->stats.num_in_use, -pages);
+  COUNT(c->stats.num_tag_frees[frame->tag], 1);
+  countPages(c, -pages);
   
-  res = (kma_page_t*) malloc(sizeof(kma_page_t));
-  res->id = id++;
-  res->size = kma_page_stats.page_size;
-  res->ptr = allocPage();
+  if (frame->order == 0 && c->count < MAGSIZE && pool_reuse == REUSE_LIFO)
+    {
+      c->mag[c->count] = frame;
+      COUNT(c->count, 1);
+      idleCache(c);
+      return;
+    }
   
-  assert(res->ptr != NULL);
+  pthread_mutex_lock(&pool_lock);
+  tickPages();
+  if (frame->order == 0 && pool_reuse == REUSE_LIFO)
+    {
+      flushCache(c, MAGSIZE / 2);
+      c->mag[c->count] = frame;
+      COUNT(c->count, 1);
+    }
+  else
+    {
+      freeFrames(frame);
+      pool_out -= pages;
+      if (pool_out == 0)
+	{
+	  idlePages();
+	}
+      else
+	{
+	  fillReserve();
+	}
+    }
   
-  return res;	
+  if (pool != NULL)
+    {
+      decayPages(FALSE);
+    }
+  pthread_mutex_unlock(&pool_lock);
 }
 
 void
-free_page(kma_page_t* ptr)
+poolFree(kma_frame_t* frame)
 {
-  assert(ptr != NULL);
-  assert(ptr->ptr != NULL);
-  assert(kma_page_stats.num_in_use > 0);
+  kma_pool_t* p = frame->owner;
+  int pages = 1 << frame->order;
+  
+  pthread_mutex_lock(&p->lock);
+  p->stats.num_freed += pages;
+  p->stats.num_in_use -= pages;
+  p->stats.num_tag_frees[frame->tag]++;
+  p->ops++;
+  p->in_use_sum += p->stats.num_in_use;
   
-  kma_page_stats.num_freed++;
-  kma_page_stats.num_in_use--;
+  // single pages stay with the pool, runs go back to the depot
+  if (frame->order == 0)
+    {
+      frame->state = HELD;
+      frame->next = p->free;
+      p->free = frame;
+      p->n_free++;
+      frame = NULL;
+    }
+  else
+    {
+      p->out -= pages;
+    }
+  pthread_mutex_unlock(&p->lock);
   
-  freePage(ptr->ptr);
-  free(ptr);
+  if (frame != NULL)
+    {
+      frame->next = NULL;
+      returnFrames(frame);
+    }
 }
 
-kma_page_stat_t*
-page_stats()
+kma_page_t*
+get_pages(int n)
+{
+  return get_pages_tagged(n, 0);
+}
+
+kma_page_t*
+get_pages_tagged(int n, int tag)
+{
+  return getPages(n, tag, -1);
+}
+
+kma_page_t*
+get_page_atomic()
+{
+  kma_cache_t* c = getCache();
+  kma_frame_t* frame;
+  
+  if (c->count > 0)
+    {
+      COUNT(c->count, -1);
+      frame = c->mag[c->count];
+    }
+  else
+    {
+      pthread_mutex_lock(&pool_lock);
+      if (pool == NULL)
+	{
+	  initPages();
+	}
+      
+      tickPages();
+      frame = takeFrames(currentNode(), 0);
+      if (frame == NULL && pool_reserve_head != NULL)
+	{
+	  frame = pool_reserve_head;
+	  pool_reserve_head = frame->next;
+	  pool_reserved--;
+	  frame->state = INUSE;
+	  pool_out++;
+	  COUNT(c->stats.num_from_reserve, 1);
+	}
+      pthread_mutex_unlock(&pool_lock);
+    }
+  
+  if (frame == NULL)
+    {
+      COUNT(c->stats.num_failed, 1);
+      return NULL;
+    }
+  
+  COUNT(c->stats.num_requested, 1);
+  COUNT(c->stats.num_in_use, 1);
+  COUNT(c->stats.num_tag_gets[0], 1);
+  countPages(c, 1);
+  
+  return initPage(c, &c->stats, frame, 0);
+}
+
+kma_page_t*
+get_page_node(int node)
+{
+  assert(node >= 0 && node < MAXNODES);
+  
+  return getPages(1, 0, node);
+}
+
+kma_page_t*
+getPages(int n, int tag, int node)
+{
+  kma_cache_t* c = getCache();
+  kma_frame_t* frame;
+  int order = 0;
+  
+  assert(tag >= 0 && tag < PAGETAGS);
+  
+  while ((1 << order) < n)
+    {
+      order++;
+    }
+  
+  if (n < 1 || order > MAXORDER)
+    {
+      return NULL;
+    }
+  
+  if (current_pool != NULL)
+    {
+      return poolPages(current_pool, order, tag, node);
+    }
+  
+  // the cache holds pages of whichever node the thread ran on when it
+  // was refilled, a page of a given node may have to come from the depot
+  if (order == 0 && c->count > 0
+      && (node < 0 || nodeOf(c->mag[c->count - 1]) == &nodes[node]))
+    {
+      COUNT(c->count, -1);
+      frame = c->mag[c->count];
+    }
+  else
+    {
+      frame = depotFrames(c, order, node, TRUE);
+      if (frame == NULL)
+	{
+	  // out of pages: have the allocators give back what they can
+	  // spare and try once more
+	  reclaimPages(c, NULL, &c->stats, 1 << order);
+	  frame = depotFrames(c, order, node, TRUE);
+	}
+      if (frame == NULL)
+	{
+	  COUNT(c->stats.num_failed, 1);
+	  return NULL;
+	}
+    }
+  
+  COUNT(c->stats.num_requested, 1 << order);
+  COUNT(c->stats.num_in_use, 1 << order);
+  COUNT(c->stats.num_tag_gets[tag], 1);
+  countPages(c, 1 << order);
+  
+  return initPage(c, &c->stats, frame, tag);
+}
+
+kma_page_t*
+poolPages(kma_pool_t* p, int order, int tag, int node)
+{
+  kma_cache_t* c = getCache();
+  kma_frame_t* frame = NULL;
+  kma_page_t* res;
+  int pages = 1 << order;
+  
+  pthread_mutex_lock(&p->lock);
+  if (order == 0 && p->free != NULL)
+    {
+      frame = p->free;
+      p->free = frame->next;
+      p->n_free--;
+      frame->state = INUSE;
+    }
+  else
+    {
+      pthread_mutex_unlock(&p->lock);
+      frame = poolDepot(p, c, order, node);
+      pthread_mutex_lock(&p->lock);
+    }
+  
+  if (frame == NULL)
+    {
+      p->stats.num_failed++;
+      pthread_mutex_unlock(&p->lock);
+      return NULL;
+    }
+  
+  p->stats.num_requested += pages;
+  p->stats.num_in_use += pages;
+  p->stats.num_tag_gets[tag]++;
+  if (p->stats.num_in_use > p->stats.num_peak)
+    p->stats.num_peak = p->stats.num_in_use;
+  p->ops++;
+  p->in_use_sum += p->stats.num_in_use;
+  frame->owner = p;
+  res = initPage(c, &p->stats, frame, tag);
+  pthread_mutex_unlock(&p->lock);
+  
+  return res;
+}
+
+kma_frame_t*
+poolDepot(kma_pool_t* p, kma_cache_t* c, int order, int node)
+{
+  kma_frame_t* frame = NULL;
+  int pages = 1 << order;
+  int pass;
+  
+  // the pool lock is dropped around the depot and the shrinkers, which
+  // may free pages to this very pool
+  for (pass = 0; pass < 2 && frame == NULL; pass++)
+    {
+      if (pass > 0)
+	{
+	  reclaimPages(c, p, &p->stats, pages);
+	}
+      
+      pthread_mutex_lock(&p->lock);
+      if (order == 0 && p->free != NULL)
+	{
+	  frame = p->free;
+	  p->free = frame->next;
+	  p->n_free--;
+	  frame->state = INUSE;
+	  pthread_mutex_unlock(&p->lock);
+	  break;
+	}
+      
+      // a run can't be made of the pages on the free list
+      if (p->quota > 0 && p->out + pages > p->quota)
+	{
+	  flushPool(p);
+	}
+      if (p->quota > 0 && p->out + pages > p->quota)
+	{
+	  pthread_mutex_unlock(&p->lock);
+	  continue;
+	}
+      p->out += pages;
+      pthread_mutex_unlock(&p->lock);
+      
+      frame = depotFrames(c, order, node, FALSE);
+      if (frame == NULL)
+	{
+	  pthread_mutex_lock(&p->lock);
+	  p->out -= pages;
+	  pthread_mutex_unlock(&p->lock);
+	}
+    }
+  
+  return frame;
+}
+
+void
+flushPool(kma_pool_t* p)
+{
+  kma_frame_t* list = p->free;
+  
+  p->out -= p->n_free;
+  p->free = NULL;
+  p->n_free = 0;
+  if (list != NULL)
+    {
+      returnFrames(list);
+    }
+}
+
+void
+returnFrames(kma_frame_t* list)
 {
-  static kma_page_stat_t stats;
+  kma_frame_t* next;
+  
+  pthread_mutex_lock(&pool_lock);
+  tickPages();
+  for (; list != NULL; list = next)
+    {
+      next = list->next;
+      list->owner = NULL;
+      pool_out -= 1 << list->order;
+      freeFrames(list);
+    }
   
-  return memcpy(&stats, &kma_page_stats, sizeof(kma_page_stat_t));
+  if (pool_out == 0)
+    {
+      idlePages();
+    }
+  else
+    {
+      fillReserve();
+    }
+  if (pool != NULL)
+    {
+      decayPages(FALSE);
+    }
+  pthread_mutex_unlock(&pool_lock);
 }
 
-void*
-allocPage()
+kma_frame_t*
+depotFrames(kma_cache_t* c, int order, int node, bool refill)
 {
-  void* res;
+  kma_frame_t* frame;
   
+  pthread_mutex_lock(&pool_lock);
   if (pool == NULL)
     {
       initPages();
     }
   
-  res = next_free_page;
+  tickPages();
+  if (order == 0 && node < 0 && refill && pool_reuse == REUSE_LIFO)
+    {
+      // refill half of the cache in one go, or as much of it as is left
+      node = currentNode();
+      while (c->count < MAGSIZE / 2
+	     && (frame = takeFrames(node, 0)) != NULL)
+	{
+	  c->mag[c->count] = frame;
+	  COUNT(c->count, 1);
+	}
+      frame = NULL;
+      if (c->count > 0)
+	{
+	  COUNT(c->count, -1);
+	  frame = c->mag[c->count];
+	}
+    }
+  else
+    {
+      frame = takeFrames(node < 0 ? currentNode() : node % pool_nodes, order);
+    }
+  
+  fillReserve();
+  decayPages(FALSE);
+  pthread_mutex_unlock(&pool_lock);
+  
+  return frame;
+}
+
+void
+reclaimPages(kma_cache_t* c, kma_pool_t* p, kma_page_stat_t* stats,
+	     int pages)
+{
+  kma_shrinker_t shrinkers[PAGESHRINKERS];
+  int i, n, freed = 0;
   
-  if (res == NULL)
+  // only the shrinkers of the pool that ran out are run, the thread's
+  // roots are that pool's
+  if (p != NULL)
     {
-      error("error: all pages already allocated", "");
+      pthread_mutex_lock(&p->lock);
+      n = p->n_shrinkers;
+      memcpy(shrinkers, p->shrinkers, n * sizeof(kma_shrinker_t));
+      pthread_mutex_unlock(&p->lock);
+    }
+  else
+    {
+      pthread_mutex_lock(&pool_lock);
+      n = pool_n_shrinkers;
+      memcpy(shrinkers, pool_shrinkers, n * sizeof(kma_shrinker_t));
+      pthread_mutex_unlock(&pool_lock);
     }
   
-  next_free_page = *((void**)next_free_page);
+  // the shrinkers give their pages back through free_page(), which takes
+  // the pool locks itself
+  for (i = 0; i < n && freed < pages; i++)
+    {
+      freed += shrinkers[i](pages - freed);
+    }
   
-  assert(res != NULL);
+  // the freed single pages may be sitting in this thread's cache, where
+  // they count against the cap and can't coalesce into runs
+  pthread_mutex_lock(&pool_lock);
+  flushCache(c, c->count);
+  pthread_mutex_unlock(&pool_lock);
   
-  return res;
+  COUNT(stats->num_reclaims, 1);
+  COUNT(stats->num_reclaimed, freed);
 }
 
 void
-freePage(void* ptr)
+free_pages(kma_page_t* ptr)
 {
-  assert(ptr != NULL);
+  free_page(ptr);
+}
+
+int
+get_pages_bulk(int n, kma_page_t** out)
+{
+  kma_cache_t* c = getCache();
+  kma_frame_t* frame;
+  int i = 0, pass, node;
+  
+  assert(n >= 0);
+  
+  if (current_pool != NULL)
+    {
+      // the pool's free list is only ever taken a page at a time
+      while (i < n && (out[i] = getPages(1, 0, -1)) != NULL)
+	{
+	  i++;
+	}
+      memset(&out[i], 0, (n - i) * sizeof(kma_page_t*));
+      return i;
+    }
+  
+  while (i < n && c->count > 0)
+    {
+      COUNT(c->count, -1);
+      out[i++] = initPage(c, &c->stats, c->mag[c->count], 0);
+    }
   
-  *((void**)ptr) = next_free_page;
-  next_free_page = ptr;
+  // take the rest straight from the depot in a single pass, and in a
+  // second one after reclaiming pages if the pool ran out
+  for (pass = 0; pass < 2 && i < n; pass++)
+    {
+      if (pass > 0)
+	{
+	  reclaimPages(c, NULL, &c->stats, n - i);
+	}
+      
+      pthread_mutex_lock(&pool_lock);
+      if (pool == NULL)
+	{
+	  initPages();
+	}
+      
+      tickPages();
+      node = currentNode();
+      while (i < n && (frame = takeFrames(node, 0)) != NULL)
+	{
+	  out[i++] = initPage(c, &c->stats, frame, 0);
+	}
+      
+      decayPages(FALSE);
+      pthread_mutex_unlock(&pool_lock);
+    }
   
-  if (kma_page_stats.num_in_use == 0)
+  if (i < n)
     {
-      free(pool);
-      pool = NULL;
-      next_free_page = NULL;
+      COUNT(c->stats.num_failed, 1);
+      memset(&out[i], 0, (n - i) * sizeof(kma_page_t*));
     }
+  
+  COUNT(c->stats.num_requested, i);
+  COUNT(c->stats.num_in_use, i);
+  COUNT(c->stats.num_tag_gets[0], i);
+  countPages(c, i);
+  
+  return i;
 }
 
 void
-initPages()
+free_pages_bulk(int n, kma_page_t** pages)
 {
-  int i;
+  kma_cache_t* c = getCache();
+  kma_frame_t* frame;
+  int i, freed = 0;
   
-  assert(next_free_page == NULL);
-  assert(pool == NULL);
+  assert(n >= 0);
+  
+  // single pages fill up the cache, whatever doesn't fit goes back to
+  // the depot under a single lock
+  for (i = 0; i < n; i++)
+    {
+      frame = (kma_frame_t*) pages[i];
+      assert(frame->state == INUSE);
+      if (frame->owner != NULL)
+	{
+	  poolFree(frame);
+	  pages[i] = NULL;
+	  continue;
+	}
+      freed += 1 << frame->order;
+      COUNT(c->stats.num_tag_frees[frame->tag], 1);
+      
+      if (frame->order == 0 && c->count < MAGSIZE && pool_reuse == REUSE_LIFO)
+	{
+	  c->mag[c->count] = frame;
+	  COUNT(c->count, 1);
+	  pages[i] = NULL;
+	}
+    }
   
-  //pool = calloc(MAXPAGES, PAGESIZE);
-  int result = posix_memalign(&pool, PAGESIZE, MAXPAGES * PAGESIZE);
-  if(result)
-    error("Error using posix_memalign to allocate memory", "");
-  next_free_page = pool;
+  COUNT(c->stats.num_freed, freed);
+  COUNT(c->stats.num_in_use, -freed);
+  countPages(c, -freed);
   
-  // use ptr to point to the next free page struct
-  for (i = 0; i < (MAXPAGES - 1); i++)
+  for (i = 0; i < n && pages[i] == NULL; i++)
+    ;
+  
+  if (i < n)
     {
-      void* ptr = (pool + i * PAGESIZE);
-      void* next = ptr + PAGESIZE;
+      pthread_mutex_lock(&pool_lock);
+      tickPages();
+      for (; i < n; i++)
+	{
+	  if (pages[i] == NULL)
+	    continue;
+	  
+	  frame = (kma_frame_t*) pages[i];
+	  pool_out -= 1 << frame->order;
+	  freeFrames(frame);
+	}
       
-      *((void**) ptr) = next;
+      if (pool_out == 0)
+	{
+	  idlePages();
+	}
+      else
+	{
+	  fillReserve();
+	}
+      if (pool != NULL)
+	{
+	  decayPages(FALSE);
+	}
+      pthread_mutex_unlock(&pool_lock);
+    }
+  
+  idleCache(c);
+}
+
+kma_page_t*
+page_of(void* ptr)
+{
+  kma_frame_t* frame;
+  size_t i, head;
+  int order;
+  
+  if (pool == NULL || ptr < pool
+      || ptr >= pool + (size_t) pool_nodes * pool_node_pages * PAGESIZE)
+    {
+      return NULL;
+    }
+  
+  i = (ptr - pool) >> PAGESHIFT;
+  if (i >= nodeOf(&frames[i])->frontier)
+    {
+      return NULL;
+    }
+  
+  // runs are aligned to their size, so the first page of the run holding
+  // ptr is one of a few aligned candidates below it
+  for (order = 0; order <= MAXORDER; order++)
+    {
+      head = i & ~(((size_t) 1 << order) - 1);
+      frame = &frames[head];
+      if (frame->state == INUSE)
+	{
+	  return (head + (1 << frame->order) > i) ? &frame->page : NULL;
+	}
+    }
+  
+  return NULL;
+}
+
+kma_page_stat_t*
+page_stats()
+{
+  static __thread kma_page_stat_t stats;
+  kma_cache_t* c;
+  long ops, in_use_sum;
+  int k;
+  
+  pthread_mutex_lock(&pool_lock);
+  memcpy(&stats, &kma_page_stats, sizeof(kma_page_stat_t));
+  ops = pool_ops;
+  in_use_sum = pool_in_use_sum;
+  for (c = caches; c != NULL; c = c->next)
+    {
+      addStats(&stats, &c->stats);
+      stats.num_in_use += PEEK(c->stats.num_in_use);
+      stats.num_cached += PEEK(c->count);
+      ops += PEEK(c->ops);
+      in_use_sum += PEEK(c->in_use_sum);
+    }
+  for (k = 0; k < pool_nodes; k++)
+    {
+      stats.num_dirty += nodes[k].stats.num_dirty;
+      stats.num_purged += nodes[k].stats.num_purged;
+      stats.num_span += nodes[k].top - nodes[k].base;
+    }
+  stats.num_reserve = pool_reserved;
+  pthread_mutex_unlock(&pool_lock);
+  
+  stats.num_peak = __atomic_load_n(&kma_page_stats.num_peak, __ATOMIC_RELAXED);
+  stats.avg_in_use = ops > 0 ? (double) in_use_sum / ops : 0.0;
+  stats.num_resident = stats.num_in_use + stats.num_dirty;
+  stats.page_size = PAGESIZE;
+  
+  return &stats;
+}
+
+int
+page_stats_reset()
+{
+  kma_cache_t* c;
+  int in_use, res;
+  
+  pthread_mutex_lock(&pool_lock);
+  in_use = kma_page_stats.num_in_use;
+  for (c = caches; c != NULL; c = c->next)
+    {
+      in_use += PEEK(c->stats.num_in_use);
+    }
+  
+  // the pages in use would otherwise count against the new start
+  res = (in_use == 0);
+  if (res)
+    {
+      memset(&kma_page_stats, 0, sizeof(kma_page_stats));
+      pool_in_use = 0;
+      pool_ops = 0;
+      pool_in_use_sum = 0;
+      for (c = caches; c != NULL; c = c->next)
+	{
+	  memset(&c->stats, 0, sizeof(c->stats));
+	  c->ops = 0;
+	  c->in_use_sum = 0;
+	  c->in_use_delta = 0;
+	}
+    }
+  pthread_mutex_unlock(&pool_lock);
+  
+  return res;
+}
+
+kma_pool_t*
+page_pool_create(int quota)
+{
+  kma_pool_t* p;
+  
+  assert(quota >= 0);
+  
+  p = calloc(1, sizeof(kma_pool_t));
+  if (p != NULL)
+    {
+      pthread_mutex_init(&p->lock, NULL);
+      p->quota = quota;
     }
   
-  *((void**)(pool + (MAXPAGES - 1) * PAGESIZE)) = NULL;
+  return p;
+}
+
+int
+page_pool_destroy(kma_pool_t* p)
+{
+  assert(p != NULL);
+  
+  pthread_mutex_lock(&p->lock);
+  if (p->stats.num_in_use > 0)
+    {
+      pthread_mutex_unlock(&p->lock);
+      return 0;
+    }
+  flushPool(p);
+  pthread_mutex_unlock(&p->lock);
+  
+  if (current_pool == p)
+    {
+      page_pool_enter(NULL);
+    }
+  pthread_mutex_destroy(&p->lock);
+  free(p);
+  
+  return 1;
+}
+
+kma_pool_t*
+page_pool_enter(kma_pool_t* p)
+{
+  kma_pool_t* res = current_pool;
+  
+  current_pool = p;
+  kma_page_roots = p != NULL ? p->roots : pool_roots;
+  
+  return res;
+}
+
+kma_page_stat_t*
+page_pool_stats(kma_pool_t* p)
+{
+  static __thread kma_page_stat_t stats;
+  
+  assert(p != NULL);
+  
+  pthread_mutex_lock(&p->lock);
+  memcpy(&stats, &p->stats, sizeof(stats));
+  stats.num_cached = p->n_free;
+  stats.avg_in_use = p->ops > 0 ? (double) p->in_use_sum / p->ops : 0.0;
+  pthread_mutex_unlock(&p->lock);
+  
+  stats.num_resident = stats.num_in_use + stats.num_cached;
+  stats.page_size = PAGESIZE;
+  
+  return &stats;
+}
+
+void
+page_reserve(int pages)
+{
+  assert(pages >= 0);
+  
+  pthread_mutex_lock(&pool_lock);
+  pool_reserve = pages;
+  if (pool != NULL)
+    {
+      drainReserve(pages);
+      fillReserve();
+    }
+  pthread_mutex_unlock(&pool_lock);
+}
+
+void
+page_cap(int pages)
+{
+  assert(pages >= 0);
+  
+  pthread_mutex_lock(&pool_lock);
+  pool_cap = pages;
+  pthread_mutex_unlock(&pool_lock);
+}
+
+int
+page_shrinker(kma_shrinker_t shrinker)
+{
+  kma_pool_t* p = current_pool;
+  pthread_mutex_t* lock = p != NULL ? &p->lock : &pool_lock;
+  kma_shrinker_t* shrinkers = p != NULL ? p->shrinkers : pool_shrinkers;
+  int* n = p != NULL ? &p->n_shrinkers : &pool_n_shrinkers;
+  int i, res = 0;
+  
+  assert(shrinker != NULL);
+  
+  pthread_mutex_lock(lock);
+  for (i = 0; i < *n; i++)
+    {
+      if (shrinkers[i] == shrinker)
+	{
+	  res = 1;
+	}
+    }
+  if (!res && *n < PAGESHRINKERS)
+    {
+      shrinkers[(*n)++] = shrinker;
+      res = 1;
+    }
+  pthread_mutex_unlock(lock);
+  
+  return res;
+}
+
+void
+page_shrinker_remove(kma_shrinker_t shrinker)
+{
+  kma_pool_t* p = current_pool;
+  pthread_mutex_t* lock = p != NULL ? &p->lock : &pool_lock;
+  kma_shrinker_t* shrinkers = p != NULL ? p->shrinkers : pool_shrinkers;
+  int* n = p != NULL ? &p->n_shrinkers : &pool_n_shrinkers;
+  int i;
+  
+  assert(shrinker != NULL);
+  
+  pthread_mutex_lock(lock);
+  for (i = 0; i < *n; i++)
+    {
+      if (shrinkers[i] == shrinker)
+	{
+	  // keep the order they were registered in
+	  memmove(&shrinkers[i], &shrinkers[i + 1],
+		  (*n - i - 1) * sizeof(kma_shrinker_t));
+	  (*n)--;
+	  break;
+	}
+    }
+  pthread_mutex_unlock(lock);
+}
+
+void
+page_retain(int pages)
+{
+  assert(pages >= -1);
+  
+  pthread_mutex_lock(&pool_lock);
+  pool_retain = pages;
+  pthread_mutex_unlock(&pool_lock);
+}
+
+int
+page_release()
+{
+  kma_cache_t* c = getCache();
+  int res;
+  
+  pthread_mutex_lock(&pool_lock);
+  flushCache(c, c->count);
+  
+  // pages in use or in the caches of other threads keep the pool alive
+  res = (pool_out == 0);
+  if (res && pool != NULL)
+    {
+      releasePages();
+    }
+  pthread_mutex_unlock(&pool_lock);
+  
+  return res;
+}
+
+int
+page_size(int size)
+{
+  int res;
+  
+  pthread_mutex_lock(&pool_lock);
+#if PAGESIZEFIXED
+  res = (size == PAGESIZE);
+#else
+  // once the pool is set up, its pages and BASEADDR depend on the size
+  res = size >= MINPAGESIZE && size <= MAXPAGESIZE
+    && (size & (size - 1)) == 0 && (pool == NULL || size == PAGESIZE);
+  if (res)
+    {
+      kma_page_shift = __builtin_ctz(size);
+    }
+#endif
+  pthread_mutex_unlock(&pool_lock);
+  
+  return res;
+}
+
+int
+page_nodes(int n)
+{
+  int res;
+  
+  assert(n >= -1 && n <= MAXNODES);
+  
+  pthread_mutex_lock(&pool_lock);
+  if (pool != NULL)
+    {
+      res = pool_nodes;
+    }
+  else
+    {
+      if (n >= 0)
+	{
+	  pool_want_nodes = n;
+	}
+      res = pool_want_nodes > 0 ? pool_want_nodes : machineNodes();
+    }
+  pthread_mutex_unlock(&pool_lock);
+  
+  return res;
+}
+
+int
+page_reuse(int policy)
+{
+  int res;
+  
+  assert(policy >= -1 && policy <= REUSE_ADDRESS);
+  
+  pthread_mutex_lock(&pool_lock);
+  // the free lists and the thread caches are laid out for the policy
+  if (pool == NULL && policy >= 0)
+    {
+      pool_reuse = policy;
+    }
+  res = pool_reuse;
+  pthread_mutex_unlock(&pool_lock);
+  
+  return res;
+}
+
+kma_node_stat_t*
+page_node_stats(int node)
+{
+  static __thread kma_node_stat_t stats;
+  
+  memset(&stats, 0, sizeof(stats));
+  
+  pthread_mutex_lock(&pool_lock);
+  if (node >= 0 && node < pool_nodes)
+    {
+      memcpy(&stats, &nodes[node].stats, sizeof(stats));
+      stats.num_committed = nodes[node].committed - nodes[node].base;
+      stats.num_span = nodes[node].top - nodes[node].base;
+    }
+  pthread_mutex_unlock(&pool_lock);
+  
+  return &stats;
+}
+
+int
+page_attach(char* path)
+{
+  int res = -1;
+  
+  pthread_mutex_lock(&pool_lock);
+  if (pool == NULL)
+    {
+      if (pool_fd >= 0)
+	close(pool_fd);
+      pool_fd = open(path, O_RDWR | O_CREAT, 0600);
+      if (pool_fd >= 0)
+	{
+	  initPages();
+	  res = pool_attached;
+	}
+    }
+  pthread_mutex_unlock(&pool_lock);
+  
+  return res;
+}
+
+int
+page_detach()
+{
+  kma_cache_t* c = getCache();
+  int res;
+  
+  pthread_mutex_lock(&pool_lock);
+  flushCache(c, c->count);
+  
+  // flushing the cache may have released an idle pool already
+  res = pool != NULL && pool_fd >= 0;
+  if (res)
+    {
+      foldCache(c);
+      detachPool();
+    }
+  pthread_mutex_unlock(&pool_lock);
+  
+  return res;
+}
+
+int
+page_hugepages(int on)
+{
+  int res;
+  
+  pthread_mutex_lock(&pool_lock);
+  res = pool_huge = on && hugeAvailable();
+  pthread_mutex_unlock(&pool_lock);
+  
+  return res;
+}
+
+void
+page_fixed(int on)
+{
+  pthread_mutex_lock(&pool_lock);
+  pool_fixed = on;
+  pthread_mutex_unlock(&pool_lock);
+}
+
+void
+page_prefault(int pages)
+{
+  assert(pages >= 0);
+  
+  pthread_mutex_lock(&pool_lock);
+  pool_prefault = pages;
+  pthread_mutex_unlock(&pool_lock);
+}
+
+void
+page_decay(long ops, long ms)
+{
+  assert(ops >= -1 && ms >= -1);
+  
+  pthread_mutex_lock(&pool_lock);
+  pool_decay_ops = ops;
+  pool_decay_ms = ms;
+  
+  if (pool != NULL)
+    {
+      pool_now = nowMs();
+      decayPages(FALSE);
+    }
+  pthread_mutex_unlock(&pool_lock);
+}
+
+int
+page_prezero(int pages)
+{
+  kma_frame_t* frame;
+  int k, res = 0;
+  
+  assert(pages >= 0);
+  
+  pthread_mutex_lock(&pool_lock);
+  for (k = 0; pool != NULL && k < pool_nodes; k++)
+    {
+      // the coldest pages first, they are the least likely to be reused
+      // before they would have been purged
+      for (frame = nodes[k].dirty_tail; frame != NULL && res < pages;
+	   frame = frame->prev)
+	{
+	  if (!frame->zero)
+	    {
+	      memset(pool + (size_t) (frame - frames) * PAGESIZE, 0, PAGESIZE);
+	      frame->zero = TRUE;
+	      res++;
+	    }
+	}
+    }
+  kma_page_stats.num_prezeroed += res;
+  pthread_mutex_unlock(&pool_lock);
+  
+  return res;
+}
+
+void
+page_purge()
+{
+  pthread_mutex_lock(&pool_lock);
+  if (pool != NULL)
+    {
+      decayPages(TRUE);
+    }
+  pthread_mutex_unlock(&pool_lock);
+}
+
+kma_frame_t*
+takeFrames(int node, int order)
+{
+  kma_frame_t* frame;
+  kma_node_t* n;
+  int i;
+  
+  if (pool_cap > 0 && pool_out + pool_reserved + (1 << order) > pool_cap)
+    {
+      return NULL;
+    }
+  
+  // the node's own partition first; once that is used up, steal from the
+  // other nodes in turn
+  for (i = 0; i < pool_nodes; i++)
+    {
+      n = &nodes[(node + i) % pool_nodes];
+      frame = allocFrames(n, order);
+      if (frame != NULL)
+	{
+	  if (i == 0)
+	    n->stats.num_local += 1 << order;
+	  else
+	    n->stats.num_stolen += 1 << order;
+	  pool_out += 1 << order;
+	  return frame;
+	}
+    }
+  
+  // all pages are out, the caller may reclaim some
+  return NULL;
+}
+
+kma_frame_t*
+allocFrames(kma_node_t* n, int order)
+{
+  kma_frame_t* frame = NULL;
+  int i, j, start;
+  
+  if (order == 0 && pool_reuse == REUSE_ADDRESS
+      && (i = lowestFree(n)) >= 0)
+    {
+      frame = &frames[i];
+      unlinkPage(frame);
+    }
+  else if (order == 0 && pool_reuse == REUSE_FIFO && n->dirty_tail != NULL)
+    {
+      // recycle the page that has been free the longest
+      frame = n->dirty_tail;
+      unlinkPage(frame);
+    }
+  else if (order == 0 && n->dirty_head != NULL)
+    {
+      // recycle the most recently freed page, it is likely still cached
+      frame = n->dirty_head;
+      unlinkPage(frame);
+    }
+  else if (order == 0 && n->purged_head != NULL)
+    {
+      // recycle a purged page, it is faulted back in on first touch
+      frame = n->purged_head;
+      unlinkPage(frame);
+    }
+  else
+    {
+      // look for the smallest free run that is large enough
+      for (j = (order == 0 ? 1 : order); j <= MAXORDER; j++)
+	{
+	  if (n->free_runs[j] != NULL)
+	    {
+	      frame = n->free_runs[j];
+	      unlinkRun(frame);
+	      break;
+	    }
+	}
+      
+      if (frame != NULL)
+	{
+	  // split the run, handing back the upper halves
+	  while (j > order)
+	    {
+	      j--;
+	      frame[1 << j].zero = frame->zero;
+	      pushFrames(frame + (1 << j), j, frame->state);
+	    }
+	  if (frame->state == DIRTY)
+	    n->stats.num_dirty -= 1 << order;
+	}
+      else
+	{
+	  // carve the run out of untouched memory, aligned to its size
+	  start = (n->frontier + (1 << order) - 1) & ~((1 << order) - 1);
+	  while (start + (1 << order) > n->committed)
+	    {
+	      if (!growPages(n))
+		return NULL;
+	    }
+	  
+	  // the alignment gap becomes free runs of untouched pages
+	  for (i = n->frontier; i < start; i += 1 << j)
+	    {
+	      for (j = 0; !(i & (1 << j)) && i + (2 << j) <= start; j++)
+		;
+	      pushFrames(&frames[i], j, PURGED);
+	    }
+	  
+	  frame = &frames[start];
+	  n->frontier = start + (1 << order);
+	}
+    }
+  
+  // a dirty page keeps its flag, it may have come back from a thread
+  // cache without ever being handed out
+  if (frame->state != DIRTY)
+    {
+      frame->fresh = TRUE;
+      frame->zero = frame->state == UNUSED || PURGEDZERO;
+    }
+  frame->state = INUSE;
+  frame->order = order;
+  n->stats.num_out += 1 << order;
+  spanPages(n, frame - frames, 1 << order, 1);
+  
+  return frame;
+}
+
+void
+freeFrames(kma_frame_t* frame)
+{
+  kma_node_t* n = nodeOf(frame);
+  kma_frame_t* buddy;
+  enum FRAME_STATE state = DIRTY;
+  int order = frame->order;
+  int i = frame - frames;
+  int b;
+  
+  n->stats.num_out -= 1 << order;
+  n->stats.num_dirty += 1 << order;
+  frame->state = state;
+  spanPages(n, i, 1 << order, -1);
+  
+  // coalesce runs with their free buddies; single pages stay on their
+  // own lists so that the common case remains a simple push; partitions
+  // are a multiple of the largest run, so buddies share a node
+  while (order > 0 && order < MAXORDER)
+    {
+      b = i ^ (1 << order);
+      buddy = &frames[b];
+      if (b + (1 << order) > n->frontier || buddy->order != order
+	  || (buddy->state != DIRTY && buddy->state != PURGED))
+	{
+	  break;
+	}
+      
+      unlinkRun(buddy);
+      
+      // a run is either resident or purged as a whole
+      if (buddy->state != state)
+	{
+	  if (state == DIRTY)
+	    purgeRun(&frames[i]);
+	  else
+	    purgeRun(buddy);
+	  state = PURGED;
+	}
+      
+      if (b < i)
+	i = b;
+      order++;
+      frames[i].zero = FALSE;
+      frames[i].state = state;
+      frames[i].order = order;
+    }
+  
+  pushFrames(&frames[i], order, state);
+}
+
+void
+pushFrames(kma_frame_t* frame, int order, enum FRAME_STATE state)
+{
+  kma_node_t* n = nodeOf(frame);
+  
+  frame->state = state;
+  frame->order = order;
+  frame->freed_op = pool_clock;
+  frame->freed_ms = pool_now;
+  frame->prev = NULL;
+  
+  if (order > 0)
+    {
+      frame->next = n->free_runs[order];
+      if (n->free_runs[order] != NULL)
+	n->free_runs[order]->prev = frame;
+      n->free_runs[order] = frame;
+    }
+  else if (state == DIRTY)
+    {
+      frame->next = n->dirty_head;
+      if (n->dirty_head != NULL)
+	n->dirty_head->prev = frame;
+      else
+	n->dirty_tail = frame;
+      n->dirty_head = frame;
+      markFree(frame - frames, TRUE);
+    }
+  else
+    {
+      frame->next = n->purged_head;
+      if (n->purged_head != NULL)
+	n->purged_head->prev = frame;
+      n->purged_head = frame;
+      markFree(frame - frames, TRUE);
+    }
+}
+
+void
+unlinkRun(kma_frame_t* frame)
+{
+  assert(frame->order > 0);
+  
+  if (frame->prev != NULL)
+    frame->prev->next = frame->next;
+  else
+    nodeOf(frame)->free_runs[frame->order] = frame->next;
+  if (frame->next != NULL)
+    frame->next->prev = frame->prev;
+}
+
+void
+unlinkPage(kma_frame_t* frame)
+{
+  kma_node_t* n = nodeOf(frame);
+  
+  assert(frame->order == 0);
+  
+  if (frame->prev != NULL)
+    frame->prev->next = frame->next;
+  else if (frame->state == DIRTY)
+    n->dirty_head = frame->next;
+  else
+    n->purged_head = frame->next;
+  
+  if (frame->next != NULL)
+    frame->next->prev = frame->prev;
+  else if (frame->state == DIRTY)
+    n->dirty_tail = frame->prev;
+  
+  if (frame->state == DIRTY)
+    n->stats.num_dirty--;
+  markFree(frame - frames, FALSE);
+}
+
+void
+spanPages(kma_node_t* n, int i, int pages, int delta)
+{
+  int g;
+  
+  // runs larger than a group cover several of them whole
+  for (g = i / SPANPAGES; g * SPANPAGES < i + pages; g++)
+    {
+      spans[g] += delta * (pages < SPANPAGES ? pages : SPANPAGES);
+    }
+  
+  if (g * SPANPAGES > n->top)
+    {
+      n->top = g * SPANPAGES;
+    }
+  
+  // once the top group is empty, the span shrinks to the next group down
+  // that still has pages out
+  while (n->top > n->base && spans[n->top / SPANPAGES - 1] == 0)
+    {
+      n->top -= SPANPAGES;
+    }
+}
+
+void
+markFree(int i, bool free)
+{
+  int level;
+  
+  if (pool_reuse != REUSE_ADDRESS)
+    {
+      return;
+    }
+  
+  // a word of a level is non-zero iff its bit in the level above is set
+  for (level = 0; level < 3; level++, i >>= MAPSHIFT)
+    {
+      if (free)
+	free_map[level][i >> MAPSHIFT] |= 1ULL << (i & 63);
+      else if ((free_map[level][i >> MAPSHIFT] &= ~(1ULL << (i & 63))) != 0)
+	break;
+    }
+}
+
+int
+lowestFree(kma_node_t* n)
+{
+  uint64_t word;
+  int lo = n->base >> (2 * MAPSHIFT);
+  int hi = (n->base + pool_node_pages) >> (2 * MAPSHIFT);
+  int i;
+  
+  // find the first set bit of the partition at the top level, then the
+  // levels below are searched one word each
+  for (i = lo; i < hi; i = (i | 63) + 1)
+    {
+      word = free_map[2][i >> MAPSHIFT] >> (i & 63);
+      if (word != 0)
+	{
+	  i += __builtin_ctzll(word);
+	  if (i >= hi)
+	    break;
+	  i = (i << MAPSHIFT) + __builtin_ctzll(free_map[1][i]);
+	  return (i << MAPSHIFT) + __builtin_ctzll(free_map[0][i]);
+	}
+    }
+  
+  return -1;
+}
+
+void
+purgeRun(kma_frame_t* frame)
+{
+  kma_node_t* n = nodeOf(frame);
+  int i = frame - frames;
+  
+  assert(frame->state == DIRTY);
+  
+  n->stats.num_dirty -= 1 << frame->order;
+  n->stats.num_purged += 1 << frame->order;
+  frame->state = PURGED;
+  purgeRange(i, i + (1 << frame->order));
+}
+
+void
+initPages()
+{
+  int k;
+  
+  assert(pool == NULL);
+  
+  pool_attached = FALSE;
+  if (pool_fd >= 0)
+    {
+      if (attachPool())
+	{
+	  pool_attached = TRUE;
+	  return;
+	}
+      mapFile();
+    }
+  else
+    {
+      mapAnonymous();
+    }
+  
+  free_map[0] = (uint64_t*) (spans + POOLPAGES / SPANPAGES);
+  free_map[1] = free_map[0] + MAPLEVEL1;
+  free_map[2] = free_map[1] + MAPLEVEL2;
+  pool_now = nowMs();
+  
+  // split the reservation into one partition per node; partitions are a
+  // multiple of MAXPAGES, so that no run straddles two of them
+  pool_numa = pool_want_nodes == 0 && machineNodes() > 1;
+  pool_nodes = pool_want_nodes > 0 ? pool_want_nodes : machineNodes();
+  pool_node_pages = POOLPAGES / pool_nodes / MAXPAGES * MAXPAGES;
+  if (POOLNODEPAGES > 0
+      && (POOLNODEPAGES + MAXPAGES - 1) / MAXPAGES * MAXPAGES < pool_node_pages)
+    pool_node_pages = (POOLNODEPAGES + MAXPAGES - 1) / MAXPAGES * MAXPAGES;
+  for (k = 0; k < pool_nodes; k++)
+    {
+      nodes[k].base = k * pool_node_pages;
+      nodes[k].frontier = nodes[k].base;
+      nodes[k].committed = nodes[k].base;
+      nodes[k].top = nodes[k].base;
+    }
+  
+  // the pages to pre-fault are shared by the nodes, growPages() faults
+  // them in as it commits them
+  for (k = 0; k < pool_nodes && pool_prefault > 0; k++)
+    {
+      while (nodes[k].committed - nodes[k].base
+	     < (pool_prefault + pool_nodes - 1) / pool_nodes
+	     && growPages(&nodes[k]))
+	;
+    }
+  
+  // pages are put on the free lists only once they are released; until
+  // then allocFrames() hands them out from the frontier, so nothing in
+  // the pool is touched here
+}
+
+void
+mapAnonymous()
+{
+  size_t length = (size_t) POOLPAGES * PAGESIZE;
+  size_t align;
+  void* base;
+  void* aligned;
+  
+  if (pool_huge < 0)
+    {
+      pool_huge = POOLHUGE && hugeAvailable();
+    }
+  
+  // reserve address space only; the slack lets us align the pool to
+  // PAGESIZE so that BASEADDR keeps working, or to HUGESIZE so that the
+  // kernel can map it with huge pages
+  align = pool_huge ? HUGESIZE : PAGESIZE;
+  base = MAP_FAILED;
+  if (pool_fixed)
+    {
+      // POOLADDRESS is aligned to any page size
+      base = mmap((void*) POOLADDRESS, length, PROT_NONE, MAP_PRIVATE
+		  | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+      if (base != MAP_FAILED && base != (void*) POOLADDRESS)
+	{
+	  munmap(base, length);
+	  base = MAP_FAILED;
+	}
+    }
+  
+  if (base != MAP_FAILED)
+    {
+      aligned = base;
+    }
+  else
+    {
+      base = mmap(NULL, length + align, PROT_NONE,
+		  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (base == MAP_FAILED)
+	error("Error using mmap to reserve the page pool", "");
+      
+      aligned = (void*) (((size_t) base + align - 1) & ~(align - 1));
+      if (aligned != base)
+	munmap(base, aligned - base);
+      munmap(aligned + length, base + align - aligned);
+    }
+  
+  // the frame table covers the whole reservation, but like the pool it
+  // is only touched as the frontier advances
+  frames = mmap(NULL, POOLPAGES * sizeof(kma_frame_t), PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (frames == MAP_FAILED)
+    error("Error using mmap to allocate the page frame table", "");
+  
+  spans = mmap(NULL, TABLESIZE, PROT_READ | PROT_WRITE,
+	       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (spans == MAP_FAILED)
+    error("Error using mmap to allocate the page span table", "");
+  
+  pool = aligned;
+}
+
+void
+mapFile()
+{
+  size_t length = FILESIZE;
+  void* base;
+  void* aligned;
+  
+  // huge pages only back anonymous memory
+  pool_huge = 0;
+  
+  // start from an empty (sparse) file of the full size
+  if (ftruncate(pool_fd, 0) != 0 || ftruncate(pool_fd, length) != 0)
+    error("Error sizing the page pool file", "");
+  
+  // the pool goes to POOLADDRESS if nothing is mapped there, anywhere
+  // else otherwise, aligned to the largest page size
+  base = mmap((void*) POOLADDRESS, length, PROT_NONE,
+	      MAP_SHARED | MAP_FIXED_NOREPLACE, pool_fd, 0);
+  if (base != (void*) POOLADDRESS)
+    {
+      if (base != MAP_FAILED)
+	munmap(base, length);
+      
+      base = mmap(NULL, length + MAXPAGESIZE, PROT_NONE,
+		  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (base == MAP_FAILED)
+	error("Error using mmap to reserve the page pool", "");
+      
+      aligned = (void*) FILEALIGN(base);
+      if (aligned != base)
+	munmap(base, aligned - base);
+      munmap(aligned + length, base + MAXPAGESIZE - aligned);
+      
+      base = mmap(aligned, length, PROT_NONE, MAP_SHARED | MAP_FIXED,
+		  pool_fd, 0);
+      if (base == MAP_FAILED)
+	error("Error using mmap to map the page pool file", "");
+    }
+  
+  // the bookkeeping in front of the pool is always accessible, the pool
+  // itself is committed as it grows
+  if (mprotect(base, POOLOFFSET, PROT_READ | PROT_WRITE))
+    error("Error using mprotect to map the page pool file", "");
+  
+  pool_super = base;
+  frames = base + FRAMEOFFSET;
+  spans = base + TABLEOFFSET;
+  pool = base + POOLOFFSET;
+  
+  memcpy(pool_super->magic, SUPERMAGIC, sizeof(SUPERMAGIC));
+  pool_super->clean = FALSE;
+  pool_super->address = base;
+  pool_super->page_shift = PAGESHIFT;
+  pool_super->pages = POOLPAGES;
+  pool_super->frame_size = sizeof(kma_frame_t);
+}
+
+bool
+attachPool()
+{
+  kma_super_t super;
+  void* base;
+  int k;
+  
+  // only a cleanly detached pool with the same layout can be attached
+  if (pread(pool_fd, &super, sizeof(super), 0) != sizeof(super)
+      || memcmp(super.magic, SUPERMAGIC, sizeof(SUPERMAGIC)) != 0
+      || !super.clean || super.pages != POOLPAGES
+      || super.frame_size != sizeof(kma_frame_t)
+      || (PAGESIZEFIXED && super.page_shift != PAGESHIFT))
+    {
+      return FALSE;
+    }
+  
+#if !PAGESIZEFIXED
+  kma_page_shift = super.page_shift;
+#endif
+  
+  base = mmap(super.address, FILESIZE, PROT_NONE,
+	      MAP_SHARED | MAP_FIXED_NOREPLACE, pool_fd, 0);
+  if (base != super.address)
+    error("Error using mmap to attach the page pool at its address", "");
+  if (mprotect(base, POOLOFFSET, PROT_READ | PROT_WRITE))
+    error("Error using mprotect to map the page pool file", "");
+  
+  pool_super = base;
+  frames = base + FRAMEOFFSET;
+  spans = base + TABLEOFFSET;
+  pool = base + POOLOFFSET;
+  free_map[0] = (uint64_t*) (spans + POOLPAGES / SPANPAGES);
+  free_map[1] = free_map[0] + MAPLEVEL1;
+  free_map[2] = free_map[1] + MAPLEVEL2;
+  
+  // the pool is live again, the copy of its state in the file is stale
+  // until the next detach
+  pool_super->clean = FALSE;
+  pool_nodes = super.nodes;
+  pool_node_pages = super.node_pages;
+  pool_numa = super.numa;
+  pool_reuse = super.reuse;
+  pool_out = super.out;
+  pool_in_use = super.in_use;
+  pool_ops = super.ops;
+  pool_in_use_sum = super.in_use_sum;
+  pool_clock = super.clock;
+  pool_now = nowMs();
+  memcpy(&kma_page_stats, &super.stats, sizeof(kma_page_stats));
+  memcpy(nodes, super.node, sizeof(nodes));
+  memcpy(pool_roots, super.roots, sizeof(pool_roots));
+  
+  for (k = 0; k < pool_nodes; k++)
+    {
+      if (mprotect(pool + (size_t) nodes[k].base * PAGESIZE,
+		   (size_t) (nodes[k].committed - nodes[k].base) * PAGESIZE,
+		   PROT_READ | PROT_WRITE))
+	{
+	  error("Error using mprotect to map the page pool file", "");
+	}
+    }
+  
+  return TRUE;
+}
+
+void
+detachPool()
+{
+  kma_super_t* super = pool_super;
+  
+  assert(pool != NULL && pool_fd >= 0);
+  
+  // the reserve is not kept in the file
+  drainReserve(0);
+  super->nodes = pool_nodes;
+  super->node_pages = pool_node_pages;
+  super->numa = pool_numa;
+  super->reuse = pool_reuse;
+  super->out = pool_out;
+  super->in_use = pool_in_use;
+  super->ops = pool_ops;
+  super->in_use_sum = pool_in_use_sum;
+  super->clock = pool_clock;
+  memcpy(&super->stats, &kma_page_stats, sizeof(kma_page_stats));
+  memcpy(super->node, nodes, sizeof(nodes));
+  memcpy(super->roots, pool_roots, sizeof(pool_roots));
+  super->clean = TRUE;
+  
+  unmapPool();
+}
+
+void
+unmapPool()
+{
+  kma_node_t* n;
+  
+  if (pool_fd >= 0)
+    {
+      munmap(pool_super, FILESIZE);
+    }
+  else
+    {
+      munmap(pool, (size_t) POOLPAGES * PAGESIZE);
+      munmap(frames, POOLPAGES * sizeof(kma_frame_t));
+      munmap(spans, TABLESIZE);
+    }
+  pool = NULL;
+  frames = NULL;
+  spans = NULL;
+  pool_super = NULL;
+  pool_reserve_head = NULL;
+  pool_reserved = 0;
+  
+  // the node statistics other than the dirty pages are kept
+  for (n = nodes; n < nodes + pool_nodes; n++)
+    {
+      n->dirty_head = NULL;
+      n->dirty_tail = NULL;
+      n->purged_head = NULL;
+      memset(n->free_runs, 0, sizeof(n->free_runs));
+      n->stats.num_dirty = 0;
+    }
+}
+
+bool
+growPages(kma_node_t* n)
+{
+  void* chunk;
+  
+  assert(pool != NULL);
+  
+  if (n->committed + MAXPAGES > n->base + pool_node_pages)
+    {
+      return FALSE;
+    }
+  
+  // commit the next chunk of the node's partition
+  chunk = pool + (size_t) n->committed * PAGESIZE;
+  if (mprotect(chunk, (size_t) MAXPAGES * PAGESIZE, PROT_READ | PROT_WRITE))
+    {
+      error("Error using mprotect to grow the page pool", "");
+    }
+  
+  // chunks are a multiple of HUGESIZE, so they can be backed by huge
+  // pages as a whole; failing that we simply keep small pages
+  if (pool_huge)
+    {
+      madvise(chunk, (size_t) MAXPAGES * PAGESIZE, MADV_HUGEPAGE);
+    }
+  
+#if POOLMBIND
+  // prefer the memory of the node itself; without NUMA support in the
+  // kernel this fails and the default policy applies
+  if (pool_numa)
+    {
+      unsigned long mask = 1UL << (n - nodes);
+      
+      syscall(SYS_mbind, chunk, (size_t) MAXPAGES * PAGESIZE, MPOL_PREFERRED,
+	      &mask, sizeof(mask) * 8, 0);
+    }
+#endif
+  
+  if (pool_prefault > 0)
+    {
+      prefaultRange(chunk, (size_t) MAXPAGES * PAGESIZE);
+      prefaultRange(frames + n->committed, MAXPAGES * sizeof(kma_frame_t));
+      kma_page_stats.num_prefaulted += MAXPAGES;
+    }
+  
+  n->committed += MAXPAGES;
+  return TRUE;
+}
+
+void
+idlePages()
+{
+  int retain, k;
+  
+  assert(pool_out == 0);
+  
+  drainReserve(0);
+  if (pool_retain == 0)
+    {
+      releasePages();
+      return;
+    }
+  
+  if (pool_retain < 0)
+    {
+      // keep everything; free pages stay on their lists and decay
+      return;
+    }
+  
+  // the nodes share the retained pages evenly
+  retain = (pool_retain + pool_nodes - 1) / pool_nodes;
+  retain = (retain + MAXPAGES - 1) / MAXPAGES * MAXPAGES;
+  for (k = 0; k < pool_nodes; k++)
+    {
+      idleNode(&nodes[k], nodes[k].base + retain);
+    }
+}
+
+void
+fillReserve()
+{
+  kma_frame_t* frame;
+  
+  // takeFrames() leaves room for the pages already in the reserve, so
+  // this only takes pages nobody else can get under the cap
+  while (pool_reserved < pool_reserve
+	 && (frame = takeFrames(currentNode(), 0)) != NULL)
+    {
+      pool_out--;
+      frame->state = HELD;
+      frame->next = pool_reserve_head;
+      pool_reserve_head = frame;
+      pool_reserved++;
+    }
+}
+
+void
+drainReserve(int keep)
+{
+  kma_frame_t* frame;
+  
+  while (pool_reserved > keep)
+    {
+      frame = pool_reserve_head;
+      pool_reserve_head = frame->next;
+      pool_reserved--;
+      frame->state = INUSE;
+      freeFrames(frame);
+    }
+}
+
+void
+idleNode(kma_node_t* n, int retain)
+{
+  kma_frame_t* frame;
+  kma_frame_t* next;
+  int i;
+  
+  if (retain >= n->committed)
+    {
+      return;
+    }
+  
+  // drop the pages past the retained prefix from the free lists; runs
+  // never straddle a chunk, so they are either kept or dropped whole
+  for (frame = n->dirty_head; frame != NULL; frame = next)
+    {
+      next = frame->next;
+      if (frame - frames >= retain)
+	unlinkPage(frame);
+    }
+  
+  for (frame = n->purged_head; frame != NULL; frame = next)
+    {
+      next = frame->next;
+      if (frame - frames >= retain)
+	unlinkPage(frame);
+    }
+  
+  for (i = 1; i <= MAXORDER; i++)
+    {
+      for (frame = n->free_runs[i]; frame != NULL; frame = frame->next)
+	{
+	  if (frame - frames < retain)
+	    continue;
+	  
+	  unlinkRun(frame);
+	  if (frame->state == DIRTY)
+	    n->stats.num_dirty -= 1 << i;
+	}
+    }
+  
+  for (i = retain; i < n->frontier; i++)
+    {
+      frames[i].state = UNUSED;
+    }
+  
+  // map fresh inaccessible memory over the excess to give it back; the
+  // mapping of a pool file has to stay, its pages are punched out of the
+  // file instead
+  if (pool_fd >= 0)
+    {
+      purgeRange(retain, n->committed);
+      if (mprotect(pool + (size_t) retain * PAGESIZE,
+		   (size_t) (n->committed - retain) * PAGESIZE, PROT_NONE))
+	{
+	  error("Error using mprotect to shrink the page pool", "");
+	}
+    }
+  else if (mmap(pool + (size_t) retain * PAGESIZE,
+		(size_t) (n->committed - retain) * PAGESIZE, PROT_NONE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+		-1, 0) == MAP_FAILED)
+    {
+      error("Error using mmap to shrink the page pool", "");
+    }
+  
+  if (n->frontier > retain)
+    n->frontier = retain;
+  n->committed = retain;
+}
+
+void
+releasePages()
+{
+  assert(pool != NULL);
+  
+  // a pool file holds no pages in use either, the next pool set up in it
+  // starts over
+  unmapPool();
+}
+
+void
+tickPages()
+{
+  pool_clock++;
+  if (pool_clock % DECAYTICK == 0 && pool_decay_ms >= 0)
+    {
+      pool_now = nowMs();
+    }
+}
+
+void
+decayPages(bool all)
+{
+  int k;
+  
+  for (k = 0; k < pool_nodes; k++)
+    {
+      decayNode(&nodes[k], all);
+    }
+}
+
+void
+decayNode(kma_node_t* n, bool all)
+{
+  kma_frame_t* frame;
+  int lo = 0, hi = 0; // pending range of pages to purge
+  int i;
+  
+  // the oldest dirty pages sit at the tail of the list
+  while ((frame = n->dirty_tail) != NULL)
+    {
+      if (!all
+	  && (pool_decay_ops < 0 || pool_clock - frame->freed_op < pool_decay_ops)
+	  && (pool_decay_ms < 0 || pool_now - frame->freed_ms < pool_decay_ms))
+	{
+	  break;
+	}
+      
+      n->dirty_tail = frame->prev;
+      if (n->dirty_tail != NULL)
+	n->dirty_tail->next = NULL;
+      else
+	n->dirty_head = NULL;
+      n->stats.num_dirty--;
+      n->stats.num_purged++;
+      
+      frame->state = PURGED;
+      frame->prev = NULL;
+      frame->next = n->purged_head;
+      if (n->purged_head != NULL)
+	n->purged_head->prev = frame;
+      n->purged_head = frame;
+      
+      // coalesce neighbouring pages into a single madvise call
+      i = frame - frames;
+      if (i == hi && hi > lo)
+	hi++;
+      else if (i == lo - 1)
+	lo--;
+      else
+	{
+	  purgeRange(lo, hi);
+	  lo = i;
+	  hi = i + 1;
+	}
+    }
+  
+  purgeRange(lo, hi);
+  
+  // free runs are few, so they are only checked every tick
+  if (!all && pool_clock % DECAYTICK != 0)
+    {
+      return;
+    }
+  
+  for (i = 1; i <= MAXORDER; i++)
+    {
+      for (frame = n->free_runs[i]; frame != NULL; frame = frame->next)
+	{
+	  if (frame->state == DIRTY
+	      && (all
+		  || (pool_decay_ops >= 0
+		      && pool_clock - frame->freed_op >= pool_decay_ops)
+		  || (pool_decay_ms >= 0
+		      && pool_now - frame->freed_ms >= pool_decay_ms)))
+	    {
+	      purgeRun(frame);
+	    }
+	}
+    }
+}
+
+void
+purgeRange(int lo, int hi)
+{
+  // dropping the pages of a shared mapping would leave them in the file
+  if (lo < hi)
+    {
+      madvise(pool + (size_t) lo * PAGESIZE, (size_t) (hi - lo) * PAGESIZE,
+	      pool_fd >= 0 ? MADV_REMOVE : PURGEADVICE);
+    }
+}
+
+kma_node_t*
+nodeOf(kma_frame_t* frame)
+{
+  // spare the division in the common single node case
+  if (pool_nodes == 1)
+    return nodes;
+  return &nodes[(frame - frames) / pool_node_pages];
+}
+
+int
+currentNode()
+{
+  unsigned int cpu, node;
+  
+  if (pool_nodes == 1 || getcpu(&cpu, &node) != 0)
+    {
+      return 0;
+    }
+  
+  // emulated nodes get the CPUs round robin
+  return (pool_numa ? node : cpu) % pool_nodes;
+}
+
+int
+machineNodes()
+{
+  char possible[64] = "";
+  char* last;
+  FILE* f;
+  int res = 1;
+  
+  // the possible nodes are listed as ranges, e.g. "0" or "0-3"
+  f = fopen("/sys/devices/system/node/possible", "r");
+  if (f != NULL)
+    {
+      if (fgets(possible, sizeof(possible), f) != NULL)
+	{
+	  last = strrchr(possible, '-');
+	  if (last == NULL)
+	    last = strrchr(possible, ',');
+	  res = atoi(last == NULL ? possible : last + 1) + 1;
+	}
+      fclose(f);
+    }
+  
+  return res < 1 ? 1 : res > MAXNODES ? MAXNODES : res;
+}
+
+void
+prefaultRange(void* start, size_t length)
+{
+  long step = sysconf(_SC_PAGESIZE);
+  volatile char* p;
+  
+  // the frame table isn't aligned to system pages
+  length += (size_t) start & (step - 1);
+  start = (void*) ((size_t) start & ~(step - 1));
+  
+#ifdef MADV_POPULATE_WRITE
+  // let the kernel fault the range in with a single call
+  if (madvise(start, length, MADV_POPULATE_WRITE) == 0)
+    return;
+#endif
+  
+  // older kernels: write to every system page; reading would only map
+  // the shared zero page. The first one may hold frames in use, so the
+  // byte is written back as it is
+  for (p = start; p < (char*) start + length; p += step)
+    {
+      *p = *p;
+    }
+}
+
+long
+nowMs()
+{
+  struct timespec ts;
+  
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int
+hugeAvailable()
+{
+  char mode[64] = "";
+  FILE* f;
+  
+  // huge pages are off unless the kernel is in "always" or "madvise" mode
+  f = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+  if (f != NULL)
+    {
+      if (fgets(mode, sizeof(mode), f) == NULL)
+	mode[0] = '\0';
+      fclose(f);
+    }
+  
+  return strstr(mode, "[never]") == NULL && mode[0] != '\0';
+}
+
+kma_cache_t*
+getCache()
+{
+  if (cache == NULL)
+    {
+      cache = calloc(1, sizeof(kma_cache_t));
+      if (cache == NULL)
+	error("unable to allocate the page cache", "");
+      
+      // hand the cache back to the depot when the thread exits
+      pthread_once(&cache_once, createCacheKey);
+      pthread_setspecific(cache_key, cache);
+      
+      pthread_mutex_lock(&pool_lock);
+      cache->next = caches;
+      caches = cache;
+      __atomic_add_fetch(&pool_threads, 1, __ATOMIC_RELAXED);
+      pthread_mutex_unlock(&pool_lock);
+    }
+  
+  return cache;
+}
+
+void
+flushCache(kma_cache_t* c, int count)
+{
+  assert(count <= c->count);
+  
+  while (count-- > 0)
+    {
+      COUNT(c->count, -1);
+      freeFrames(c->mag[c->count]);
+      pool_out--;
+    }
+  
+  if (pool_out == 0 && pool != NULL)
+    {
+      idlePages();
+    }
+  else if (pool != NULL)
+    {
+      fillReserve();
+    }
+}
+
+void
+idleCache(kma_cache_t* c)
+{
+  // a lone thread gives its cache back once it has freed everything, so
+  // that the pool can go idle
+  if (c->count > 0
+      && __atomic_load_n(&pool_threads, __ATOMIC_RELAXED) == 1
+      && __atomic_load_n(&kma_page_stats.num_in_use, __ATOMIC_RELAXED)
+	 + c->stats.num_in_use == 0)
+    {
+      pthread_mutex_lock(&pool_lock);
+      flushCache(c, c->count);
+      pthread_mutex_unlock(&pool_lock);
+    }
+}
+
+kma_page_t*
+initPage(kma_cache_t* c, kma_page_stat_t* stats, kma_frame_t* frame, int tag)
+{
+  kma_page_t* res;
+  
+  // the descriptor lives in the frame table, no need to malloc it
+  res = &frame->page;
+  res->id = frame - frames;
+  res->size = PAGESIZE << frame->order;
+  res->ptr = pool + (size_t) (frame - frames) * PAGESIZE;
+  memset(res->slot, 0, sizeof(res->slot));
+  
+  // colors rotate per thread, whichever pages the thread gets back
+  res->color = c->color * COLORSTEP;
+  c->color = (c->color + 1) % PAGECOLORS;
+  
+  if (frame->fresh)
+    COUNT(stats->num_fresh, 1 << frame->order);
+  else
+    COUNT(stats->num_reused, 1 << frame->order);
+  frame->fresh = FALSE;
+  
+  // from here on it's up to the caller what's in the run
+  res->zero = frame->zero;
+  if (frame->zero)
+    COUNT(stats->num_zero, 1 << frame->order);
+  frame->zero = FALSE;
+  frame->tag = tag;
+  
+  return res;
+}
+
+void
+countPages(kma_cache_t* c, int pages)
+{
+  int in_use, peak;
+  
+  c->in_use_delta += pages;
+  if (c->in_use_delta >= INUSEBATCH || c->in_use_delta <= -INUSEBATCH)
+    {
+      __atomic_add_fetch(&pool_in_use, c->in_use_delta, __ATOMIC_RELAXED);
+      c->in_use_delta = 0;
+    }
+  in_use = __atomic_load_n(&pool_in_use, __ATOMIC_RELAXED) + c->in_use_delta;
+  
+  // the peak only moves while the pool grows, so the exchange is rare
+  peak = __atomic_load_n(&kma_page_stats.num_peak, __ATOMIC_RELAXED);
+  while (in_use > peak
+	 && !__atomic_compare_exchange_n(&kma_page_stats.num_peak, &peak,
+					 in_use, TRUE, __ATOMIC_RELAXED,
+					 __ATOMIC_RELAXED))
+    ;
+  
+  COUNT(c->ops, 1);
+  COUNT(c->in_use_sum, in_use);
+}
+
+void
+addStats(kma_page_stat_t* to, kma_page_stat_t* from)
+{
+  int i;
+  
+  // from may be the statistics of another thread's cache
+  to->num_requested += PEEK(from->num_requested);
+  to->num_freed += PEEK(from->num_freed);
+  to->num_fresh += PEEK(from->num_fresh);
+  to->num_reused += PEEK(from->num_reused);
+  to->num_zero += PEEK(from->num_zero);
+  to->num_reclaims += PEEK(from->num_reclaims);
+  to->num_reclaimed += PEEK(from->num_reclaimed);
+  to->num_failed += PEEK(from->num_failed);
+  to->num_from_reserve += PEEK(from->num_from_reserve);
+  for (i = 0; i < PAGETAGS; i++)
+    {
+      to->num_tag_gets[i] += PEEK(from->num_tag_gets[i]);
+      to->num_tag_frees[i] += PEEK(from->num_tag_frees[i]);
+    }
+}
+
+void
+foldCache(kma_cache_t* c)
+{
+  // fold the thread's statistics into the global ones
+  addStats(&kma_page_stats, &c->stats);
+  pool_ops += c->ops;
+  pool_in_use_sum += c->in_use_sum;
+  __atomic_add_fetch(&pool_in_use, c->in_use_delta, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&kma_page_stats.num_in_use, c->stats.num_in_use,
+		     __ATOMIC_RELAXED);
+  
+  memset(&c->stats, 0, sizeof(c->stats));
+  c->ops = 0;
+  c->in_use_sum = 0;
+  c->in_use_delta = 0;
+}
+
+void
+createCacheKey()
+{
+  pthread_key_create(&cache_key, retireCache);
+}
+
+void
+retireCache(void* arg)
+{
+  kma_cache_t* c = arg;
+  kma_cache_t** link;
+  
+  pthread_mutex_lock(&pool_lock);
+  flushCache(c, c->count);
+  foldCache(c);
+  
+  for (link = &caches; *link != c; link = &(*link)->next)
+    ;
+  *link = c->next;
+  __atomic_sub_fetch(&pool_threads, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&pool_lock);
+  
+  free(c);
 }
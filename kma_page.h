@@ -71,10 +71,126 @@
 #define EXTERN extern
 #endif
 
-#define PAGESIZE 8192
+// the page size is picked when the pool is set up (page_size()) among the
+// powers of two from MINPAGESIZE to MAXPAGESIZE and defaults to
+// POOLPAGESIZE; defining PAGESIZE at compile time fixes it instead, so
+// that all page size arithmetic is folded into constants
+#define MINPAGESIZE 4096
+#define MAXPAGESIZE 65536
+#ifndef POOLPAGESIZE
+#define POOLPAGESIZE 8192
+#endif
+
+#ifdef PAGESIZE
+#define PAGESIZEFIXED 1
+#define PAGESHIFT (__builtin_ctz(PAGESIZE))
+#else
+#define PAGESIZEFIXED 0
+#define PAGESHIFT kma_page_shift
+#define PAGESIZE (1 << kma_page_shift)
+#endif
 
+// pages committed to the pool at a time
 #define MAXPAGES 4096
 
+// pages of address space reserved for the pool up front (8 GB); the pool
+// grows in MAXPAGES chunks until this is exhausted
+#define POOLPAGES (256 * MAXPAGES)
+
+// pages the pool keeps committed once all pages have been freed (shared
+// by the nodes, each share rounded up to MAXPAGES); -1 keeps everything,
+// 0 releases the whole pool
+#ifndef POOLRETAIN
+#define POOLRETAIN MAXPAGES
+#endif
+
+// back the pool with transparent huge pages: the reservation is aligned
+// to HUGESIZE and marked with MADV_HUGEPAGE when the kernel supports it
+#define HUGESIZE (2 * 1024 * 1024)
+#ifndef POOLHUGE
+#define POOLHUGE 0
+#endif
+
+// freed pages stay resident (dirty) until they have been free for
+// POOLDECAYOPS page operations or POOLDECAYMS milliseconds, after which
+// they are purged; -1 disables either bound
+#ifndef POOLDECAYOPS
+#define POOLDECAYOPS -1
+#endif
+#ifndef POOLDECAYMS
+#define POOLDECAYMS 10000
+#endif
+
+// pages the pool commits and pre-faults when it is set up, so that their
+// first use doesn't pay a page fault; once this is non-zero, chunks the
+// pool commits later are pre-faulted as well. Purged pages fault again,
+// so pair this with a long decay (POOLDECAYMS -1) for flat latency
+#ifndef POOLPREFAULT
+#define POOLPREFAULT 0
+#endif
+
+// which free single page is handed out next: the most recently freed
+// one (LIFO, likely still cached), the one freed longest ago (FIFO), or
+// the lowest one (ADDRESS, keeps the pages in use packed at the start of
+// the pool); the thread caches are LIFO, so the other policies bypass
+// them and take the pool lock on every page operation
+#define REUSE_LIFO 0
+#define REUSE_FIFO 1
+#define REUSE_ADDRESS 2
+#ifndef POOLREUSE
+#define POOLREUSE REUSE_LIFO
+#endif
+
+// a pool backed by a file (page_attach()) is mapped at POOLADDRESS if it
+// is free, and at the same address again when a later process attaches
+// the file, so that the pointers stored in it stay valid
+#ifndef POOLADDRESS
+#define POOLADDRESS 0x600000000000UL
+#endif
+
+// with POOLFIXED (or page_fixed()) an anonymous pool goes to POOLADDRESS
+// as well, so that its pages have the same addresses in every run rather
+// than wherever address space randomization puts them
+#ifndef POOLFIXED
+#define POOLFIXED 0
+#endif
+
+// pages that may be out of the depot at any one time, 0 for no limit
+// but the reservation; once the pool runs out, the allocators that
+// registered a shrinker (page_shrinker()) are asked to give back the
+// pages they can spare before a get fails
+#ifndef POOLCAP
+#define POOLCAP 0
+#endif
+#define PAGESHRINKERS 8
+
+// single pages set aside for get_page_atomic(), which draws on them once
+// the pool has run out; the cap includes them, so that other gets leave
+// them alone. They are topped up as soon as a page operation finds room
+// for them again, and given back while the pool is idle
+#ifndef POOLRESERVE
+#define POOLRESERVE 0
+#endif
+
+// the pool is split into one partition per NUMA node, pages are taken
+// from the node of the calling thread's CPU and from the other nodes only
+// once its partition is used up; POOLNODES 0 follows the machine's nodes,
+// any other number emulates that many nodes, spreading the CPUs over them
+#define MAXNODES 64
+#ifndef POOLNODES
+#define POOLNODES 0
+#endif
+// pages per partition, 0 to split the whole reservation evenly; rounded up
+// to a multiple of MAXPAGES, a small one makes emulated nodes run dry, and
+// steal, early
+#ifndef POOLNODEPAGES
+#define POOLNODEPAGES 0
+#endif
+// bind the partitions of real nodes to them with mbind()
+#ifndef POOLMBIND
+#define POOLMBIND 1
+#endif
+
 /***********************************************************************
  *  Title: Base Address Macro
  * ---------------------------------------------------------------------
@@ -85,22 +201,96 @@
  ***********************************************************************/
 #define BASEADDR(x) ((void*)(((long) (x)) & ~(PAGESIZE-1)))
 
+// per page words the allocators may use as they see fit
+#define PAGESLOTS 4
+
+// consecutive pages get headers at rotating offsets of COLORSTEP bytes,
+// PAGECOLORS apart, so that the headers of page aligned allocators don't
+// all compete for the same cache sets; 1 disables coloring
+#define COLORSTEP 64
+#ifndef PAGECOLORS
+#define PAGECOLORS 8
+#endif
+
 typedef struct
 {
   int id;
   void* ptr;
   int size;
+  void* slot[PAGESLOTS]; // cleared when the page is handed out
+  int color; // suggested offset of in-page headers, may be lowered
+  int zero;  // the page (run) was all zeroes when it was handed out
 } kma_page_t;
 
+// granularity of the pool span in the statistics
+#define SPANPAGES 64
+
+// caller tags pages can be requested with, for per caller accounting
+#define PAGETAGS 16
+
 typedef struct
 {
   int num_requested;
   int num_freed;
   int num_in_use;
   int page_size;
+  int num_resident; // pages in use or dirty
+  int num_dirty;    // free pages not yet returned to the system
+  int num_purged;   // pages returned to the system so far
+  int num_cached;   // free pages held in per thread caches
+  int num_prefaulted; // pages faulted in ahead of their first use
+  int num_span;     // pages up to the last one in use, in SPANPAGES steps
+  int num_peak;     // most pages in use at any one time
+  double avg_in_use; // pages in use, averaged over all page operations
+  int num_fresh;    // pages handed out untouched (new or purged)
+  int num_reused;   // pages handed out while still resident
+  int num_zero;     // pages handed out known to be all zeroes
+  int num_prezeroed; // free pages cleared ahead of time (page_prezero())
+  int num_reclaims; // times the pool ran out and the shrinkers were run
+  int num_reclaimed; // pages the shrinkers gave back
+  int num_failed;   // gets that failed even after reclaiming pages
+  int num_reserve;  // pages set aside for atomic gets right now
+  int num_from_reserve; // atomic gets served from the reserve
+  int num_tag_gets[PAGETAGS];  // get calls per caller tag
+  int num_tag_frees[PAGETAGS]; // free calls per tag the page was got with
 } kma_page_stat_t;
 
+typedef struct
+{
+  int num_out;       // pages handed out and not returned, including those
+                     // sitting in thread caches
+  int num_committed; // pages of the partition that are accessible
+  int num_dirty;
+  int num_purged;
+  int num_local;     // pages handed out for requests on this node
+  int num_stolen;    // pages handed out for requests on other nodes
+  int num_span;      // pages from the start of the partition up to the
+                     // last group of SPANPAGES pages holding pages out
+} kma_node_stat_t;
+
+// the allocators keep their globals among the roots of the pool, so that
+// they are saved with a pool file and come back when it is attached; the
+// last one is left to the application. Every kma_pool_t has roots of its
+// own, so an allocator works on the pool its thread entered
+#define PAGEROOTS 4
+
+// a tenant of the page pool (page_pool_create()): it has its own quota,
+// statistics, free list, roots and shrinkers, and its pages are never handed out to
+// anyone else
+typedef struct kma_pool kma_pool_t;
+
+// asked to free at least the given number of pages the allocator holds
+// without needing them, returns the number of pages it freed; it runs in
+// the thread whose get ran out, from within that get, so kma_page_roots
+// are those of the pool it was registered with
+typedef int (*kma_shrinker_t)(int);
+
 /************Global Variables*********************************************/
+// log2 of the page size, only changes while the pool is not set up
+EXTERN int kma_page_shift;
+// the roots of the pool the calling thread entered, the default pool's
+// unless it entered a kma_pool_t
+EXTERN __thread void** kma_page_roots;
 
 /************Function Prototypes******************************************/
 
@@ -109,10 +299,43 @@ typedef struct
  * ---------------------------------------------------------------------
  *    Purpose: Allocates a memory page
  *    Input: none
- *    Output: the allocated memory page
+ *    Output: the allocated memory page, or NULL if the pool ran out
+ *            even after the shrinkers were run
  ***********************************************************************/
 EXTERN kma_page_t* get_page();
 
+/***********************************************************************
+ *  Title: Allocates a memory page on behalf of a caller
+ * ---------------------------------------------------------------------
+ *    Purpose: Like get_page(), but accounts the page to a caller tag
+ *    Input: the caller tag, 0 to PAGETAGS - 1 (get_page() uses 0)
+ *    Output: the page
+ ***********************************************************************/
+EXTERN kma_page_t* get_page_tagged(int tag);
+
+/***********************************************************************
+ *  Title: Allocates a memory page without waiting
+ * ---------------------------------------------------------------------
+ *    Purpose: Like get_page(), for callers that can't wait for pages to
+ *             be reclaimed and shouldn't fail: the shrinkers are never
+ *             run, and if the pool ran out the page comes from the
+ *             reserve (page_reserve()); always from the default pool
+ *    Input: none
+ *    Output: the page, or NULL if the reserve ran out too
+ ***********************************************************************/
+EXTERN kma_page_t* get_page_atomic();
+
+/***********************************************************************
+ *  Title: Allocates a memory page of a node
+ * ---------------------------------------------------------------------
+ *    Purpose: Like get_page(), but takes the page from the given node
+ *             rather than the node the calling thread runs on; falls
+ *             back to the other nodes if the node has none left
+ *    Input: the node, 0 to page_nodes() - 1
+ *    Output: the page
+ ***********************************************************************/
+EXTERN kma_page_t* get_page_node(int node);
+
 /***********************************************************************
  *  Title: Releases a memory page 
  * ---------------------------------------------------------------------
@@ -122,6 +345,69 @@ EXTERN kma_page_t* get_page();
  ***********************************************************************/
 EXTERN void free_page(kma_page_t*);
 
+/***********************************************************************
+ *  Title: Allocates contiguous memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Allocates a run of at least n contiguous pages; the run
+ *             is rounded up to a power of two pages and aligned to its
+ *             size within the pool
+ *    Input: the number of pages, at most MAXPAGES
+ *    Output: the allocated run, its size covers the whole run, or NULL
+ *            if n is out of range or the pool ran out
+ ***********************************************************************/
+EXTERN kma_page_t* get_pages(int n);
+
+/***********************************************************************
+ *  Title: Allocates contiguous memory pages on behalf of a caller
+ * ---------------------------------------------------------------------
+ *    Purpose: Like get_pages(), but accounts the run to a caller tag
+ *    Input: the number of pages and the caller tag, 0 to PAGETAGS - 1
+ *    Output: the first page of the run, or NULL
+ ***********************************************************************/
+EXTERN kma_page_t* get_pages_tagged(int n, int tag);
+
+/***********************************************************************
+ *  Title: Releases contiguous memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Releases a run of pages returned by get_pages(); free
+ *             runs coalesce with their neighbours
+ *    Input: the pointer to the memory page structure
+ *    Output: none
+ ***********************************************************************/
+EXTERN void free_pages(kma_page_t*);
+
+/***********************************************************************
+ *  Title: Allocates memory pages in bulk
+ * ---------------------------------------------------------------------
+ *    Purpose: Allocates n single pages at once, paying for the locking
+ *             and bookkeeping only once
+ *    Input: the number of pages and an array to store them in
+ *    Output: the number of pages allocated; fewer than n only if the
+ *            pool ran out, the rest of the array is set to NULL
+ ***********************************************************************/
+EXTERN int get_pages_bulk(int n, kma_page_t** out);
+
+/***********************************************************************
+ *  Title: Releases memory pages in bulk
+ * ---------------------------------------------------------------------
+ *    Purpose: Releases n pages at once, paying for the locking and
+ *             bookkeeping only once
+ *    Input: the number of pages and an array holding them
+ *    Output: none
+ ***********************************************************************/
+EXTERN void free_pages_bulk(int n, kma_page_t** pages);
+
+/***********************************************************************
+ *  Title: Page lookup
+ * ---------------------------------------------------------------------
+ *    Purpose: Find the page structure of the page or run of pages that
+ *             contains a pointer, in constant time
+ *    Input: a pointer into an allocated page
+ *    Output: the memory page structure, or NULL if the pointer is not
+ *            inside an allocated page
+ ***********************************************************************/
+EXTERN kma_page_t* page_of(void*);
+
 /***********************************************************************
  *  Title: Memory page statistics
  * ---------------------------------------------------------------------
@@ -131,6 +417,280 @@ EXTERN void free_page(kma_page_t*);
  ***********************************************************************/
 EXTERN kma_page_stat_t* page_stats();
 
+/***********************************************************************
+ *  Title: Memory page statistics reset
+ * ---------------------------------------------------------------------
+ *    Purpose: Start the statistics of the default pool over, such as
+ *             between benchmark runs; only possible while none of its
+ *             pages are in use and no other thread is getting or freeing
+ *             pages
+ *    Input: none
+ *    Output: 1 if the statistics were reset, 0 otherwise
+ ***********************************************************************/
+EXTERN int page_stats_reset();
+
+/***********************************************************************
+ *  Title: Node statistics
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the statistics of one partition of the pool
+ *    Input: the node
+ *    Output: the node's statistics, all zero if the pool has no such
+ *            node; valid until the next call from the same thread
+ ***********************************************************************/
+EXTERN kma_node_stat_t* page_node_stats(int node);
+
+/***********************************************************************
+ *  Title: Page pool nodes
+ * ---------------------------------------------------------------------
+ *    Purpose: Set the number of nodes the pool is split into; like the
+ *             page size this only changes while the pool is not set up
+ *    Input: the number of emulated nodes up to MAXNODES, 0 for the
+ *           machine's NUMA nodes, or -1 to leave it unchanged
+ *    Output: the number of nodes the pool is (or will be) split into
+ ***********************************************************************/
+EXTERN int page_nodes(int);
+
+/***********************************************************************
+ *  Title: Page reuse policy
+ * ---------------------------------------------------------------------
+ *    Purpose: Pick which free page is handed out next; like the page
+ *             size this only changes while the pool is not set up
+ *    Input: REUSE_LIFO, REUSE_FIFO, REUSE_ADDRESS, or -1 to leave it
+ *           unchanged
+ *    Output: the policy the pool uses (or will use)
+ ***********************************************************************/
+EXTERN int page_reuse(int);
+
+/***********************************************************************
+ *  Title: Page pool retention
+ * ---------------------------------------------------------------------
+ *    Purpose: Set how many pages stay committed when the pool becomes
+ *             idle (no pages in use); -1 keeps all of them, 0 releases
+ *             the pool like page_release() does
+ *    Input: the number of pages to retain
+ *    Output: none
+ ***********************************************************************/
+EXTERN void page_retain(int);
+
+/***********************************************************************
+ *  Title: Page pool release
+ * ---------------------------------------------------------------------
+ *    Purpose: Return the page pool to the system; only possible while
+ *             no pages are in use
+ *    Input: none
+ *    Output: 1 if the pool was released, 0 otherwise
+ ***********************************************************************/
+EXTERN int page_release();
+
+/***********************************************************************
+ *  Title: Tenant pool creation
+ * ---------------------------------------------------------------------
+ *    Purpose: Create a pool that takes its pages from the page pool but
+ *             keeps them apart: the single pages it frees go to its own
+ *             free list, behind its own lock, and only go back to the
+ *             page pool when it is destroyed or needs room for a run;
+ *             gets that would take more pages than the quota return NULL
+ *    Input: the quota, in pages held (in use or on the free list), 0 for
+ *           no quota
+ *    Output: the pool, or NULL if it can't be allocated
+ ***********************************************************************/
+EXTERN kma_pool_t* page_pool_create(int quota);
+
+/***********************************************************************
+ *  Title: Tenant pool destruction
+ * ---------------------------------------------------------------------
+ *    Purpose: Give the free pages of a pool back to the page pool and
+ *             free it; only possible once all its pages were freed, and
+ *             no thread may have it entered afterwards
+ *    Input: the pool
+ *    Output: 1 if the pool was destroyed, 0 if it still has pages in use
+ ***********************************************************************/
+EXTERN int page_pool_destroy(kma_pool_t*);
+
+/***********************************************************************
+ *  Title: Tenant pool selection
+ * ---------------------------------------------------------------------
+ *    Purpose: Make the calling thread's gets take pages from a pool and
+ *             point kma_page_roots at its roots, so that the allocators
+ *             run on it; pages are always freed to the pool they came
+ *             from, whichever pool the freeing thread entered
+ *    Input: the pool, NULL for the default one
+ *    Output: the pool the thread had entered before
+ ***********************************************************************/
+EXTERN kma_pool_t* page_pool_enter(kma_pool_t*);
+
+/***********************************************************************
+ *  Title: Tenant pool statistics
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the statistics of the pages got from a pool; those of
+ *             the default pool (page_stats()) leave them out, apart from
+ *             the figures of the depot as a whole (resident, dirty,
+ *             purged and span)
+ *    Input: the pool
+ *    Output: the pool's statistics, valid until the next call from the
+ *            same thread; num_cached counts its free list
+ ***********************************************************************/
+EXTERN kma_page_stat_t* page_pool_stats(kma_pool_t*);
+
+/***********************************************************************
+ *  Title: Page pool cap
+ * ---------------------------------------------------------------------
+ *    Purpose: Limit the number of pages out of the depot, in use or
+ *             in the thread caches; gets beyond it fail once reclaiming
+ *             pages didn't help. Lowering the cap below the pages out
+ *             doesn't take any back
+ *    Input: the number of pages, 0 for no limit
+ *    Output: none
+ ***********************************************************************/
+EXTERN void page_cap(int);
+
+/***********************************************************************
+ *  Title: Atomic page reserve
+ * ---------------------------------------------------------------------
+ *    Purpose: Set how many single pages are set aside for
+ *             get_page_atomic(); the reserve is filled right away as
+ *             far as the pool allows and topped up later on
+ *    Input: the number of pages, 0 for no reserve
+ *    Output: none
+ ***********************************************************************/
+EXTERN void page_reserve(int);
+
+/***********************************************************************
+ *  Title: Page shrinker registration
+ * ---------------------------------------------------------------------
+ *    Purpose: Register a function that frees pages an allocator holds
+ *             on to without needing them, such as empty pages kept for
+ *             later, with the pool the calling thread entered; when that
+ *             pool runs out, its shrinkers are run in the order they were
+ *             registered, without the pool lock held, until enough pages
+ *             came back
+ *    Input: the shrinker
+ *    Output: 1 if it is registered (or already was), 0 if the pool has
+ *            PAGESHRINKERS already
+ ***********************************************************************/
+EXTERN int page_shrinker(kma_shrinker_t);
+
+/***********************************************************************
+ *  Title: Page shrinker removal
+ * ---------------------------------------------------------------------
+ *    Purpose: Unregister a shrinker from the pool the calling thread
+ *             entered, once the roots it works on are gone
+ *    Input: the shrinker
+ *    Output: none
+ ***********************************************************************/
+EXTERN void page_shrinker_remove(kma_shrinker_t);
+
+/***********************************************************************
+ *  Title: Page pool file
+ * ---------------------------------------------------------------------
+ *    Purpose: Back the pool with a file and set it up right away; a
+ *             file that was detached cleanly (page_detach()) is mapped
+ *             back with the pages, the free lists, the statistics and
+ *             the roots it held, taking its page size with it; any
+ *             other file is truncated and holds a new pool. Only
+ *             possible while the pool is not set up
+ *    Input: the path of the file
+ *    Output: 1 if the pool was attached, 0 if a new one was created, -1
+ *            if the pool is already set up or the file can't be opened
+ ***********************************************************************/
+EXTERN int page_attach(char*);
+
+/***********************************************************************
+ *  Title: Page pool file detach
+ * ---------------------------------------------------------------------
+ *    Purpose: Save the state of a file backed pool in the file and
+ *             unmap it, so that another process can attach it; the
+ *             pages in the caches of other threads are lost, so this is
+ *             meant to be called by the last thread using the pool,
+ *             and the pool can't be used before page_attach() maps it
+ *             back. Only the default pool's roots are saved, the pages
+ *             of a kma_pool_t stay out of the depot for good
+ *    Input: none
+ *    Output: 1 if the pool was detached, 0 if it isn't file backed or
+ *            not set up
+ ***********************************************************************/
+EXTERN int page_detach();
+
+/***********************************************************************
+ *  Title: Page size
+ * ---------------------------------------------------------------------
+ *    Purpose: Pick the page size of the pool; only possible while the
+ *             pool is not set up, i.e. before the first page is handed
+ *             out or after page_release()
+ *    Input: the page size in bytes, a power of two from MINPAGESIZE to
+ *           MAXPAGESIZE
+ *    Output: 1 if the pool uses that page size, 0 otherwise
+ ***********************************************************************/
+EXTERN int page_size(int);
+
+/***********************************************************************
+ *  Title: Huge page backed pool
+ * ---------------------------------------------------------------------
+ *    Purpose: Turn transparent huge page backing of the pool on or off;
+ *             takes effect the next time the pool is created
+ *    Input: 1 to use huge pages, 0 otherwise
+ *    Output: 1 if the pool will be backed by huge pages, 0 if they are
+ *            off or not available
+ ***********************************************************************/
+EXTERN int page_hugepages(int);
+
+/***********************************************************************
+ *  Title: Fixed pool address
+ * ---------------------------------------------------------------------
+ *    Purpose: Map the pool at POOLADDRESS, or anywhere, the next time
+ *             it is created; if something is mapped there already it
+ *             goes anywhere regardless
+ *    Input: 1 for POOLADDRESS, 0 for anywhere
+ *    Output: none
+ ***********************************************************************/
+EXTERN void page_fixed(int);
+
+/***********************************************************************
+ *  Title: Pre-faulted pool
+ * ---------------------------------------------------------------------
+ *    Purpose: Set how many pages are committed and faulted in when the
+ *             pool is created, trading a slower start for no page
+ *             faults on first use; any non-zero number also pre-faults
+ *             the chunks committed later on
+ *    Input: the number of pages, 0 to fault pages in on first touch
+ *    Output: none
+ ***********************************************************************/
+EXTERN void page_prefault(int);
+
+/***********************************************************************
+ *  Title: Dirty page decay
+ * ---------------------------------------------------------------------
+ *    Purpose: Set how long freed pages stay resident before they are
+ *             purged, in page operations and in milliseconds; a page is
+ *             purged as soon as either bound is reached, -1 disables a
+ *             bound and 0 purges pages as soon as they are freed
+ *    Input: the operation and the time bound
+ *    Output: none
+ ***********************************************************************/
+EXTERN void page_decay(long, long);
+
+/***********************************************************************
+ *  Title: Free page pre-zeroing
+ * ---------------------------------------------------------------------
+ *    Purpose: Clear the free single pages that have been dirty the
+ *             longest, so that they are handed out known to be zero
+ *             (kma_page_t.zero) while staying resident; meant to be
+ *             called while the caller would be idle anyway, the pool
+ *             lock is held throughout
+ *    Input: the most pages to clear
+ *    Output: the number of pages cleared
+ ***********************************************************************/
+EXTERN int page_prezero(int);
+
+/***********************************************************************
+ *  Title: Dirty page purge
+ * ---------------------------------------------------------------------
+ *    Purpose: Purge all dirty pages right away
+ *    Input: none
+ *    Output: none
+ ***********************************************************************/
+EXTERN void page_purge();
+
 /************External Declaration*****************************************/
 
 /**************Definition***************************************************/
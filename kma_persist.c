@@ -0,0 +1,204 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Warm restart benchmark, attaching a pool file compared to
+ *             rebuilding the heap by replaying a trace
+ ***************************************************************************/
+
+/************************************************************************
+ Project Group: abg341, zta515
+
+ ***************************************************************************/
+
+/************System include***********************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+#include "kma_trace.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+// the request table is kept in the pool, under the application's root
+#define TABLEROOT (PAGEROOTS - 1)
+
+typedef struct
+{
+  void* ptr;
+  int size;
+} mem_t;
+
+/************Global Variables*********************************************/
+static kma_op_t* ops = NULL;
+static int n_ops = 0;
+static int n_req = 0;
+
+/************Function Prototypes******************************************/
+mem_t* newTable();
+void replay(mem_t*, int, int);
+void verify(mem_t*);
+double now();
+void usage();
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+char *name = NULL;
+
+int
+main(int argc, char* argv[])
+{
+  kma_page_stat_t* stat;
+  mem_t* table;
+  double begin;
+  int split;
+
+  name = argv[0];
+
+  if (argc == 4 && strcmp(argv[1], "rebuild") == 0)
+    {
+      // a cold start: the heap is built by replaying the trace up to the
+      // split
+      ops = trace_load(argv[2], &n_req, &n_ops);
+      split = atoi(argv[3]);
+      begin = now();
+      table = newTable();
+      replay(table, 0, split);
+      printf("rebuild: %d ops in %.3f ms\n", split, (now() - begin) * 1000);
+    }
+  else if (argc == 5 && strcmp(argv[1], "save") == 0)
+    {
+      ops = trace_load(argv[3], &n_req, &n_ops);
+      split = atoi(argv[4]);
+      if (page_attach(argv[2]) < 0)
+	error("unable to set up the pool file", argv[2]);
+      table = newTable();
+      replay(table, 0, split);
+      if (!page_detach())
+	error("unable to detach the pool file", argv[2]);
+      printf("save: %d ops\n", split);
+      return 0;
+    }
+  else if (argc == 5 && strcmp(argv[1], "attach") == 0)
+    {
+      // a warm start: the heap saved at the split comes back as it was
+      ops = trace_load(argv[3], &n_req, &n_ops);
+      split = atoi(argv[4]);
+      begin = now();
+      if (page_attach(argv[2]) != 1)
+	error("unable to attach the pool file", argv[2]);
+      table = kma_page_roots[TABLEROOT];
+      printf("attach: %.3f ms\n", (now() - begin) * 1000);
+      verify(table);
+    }
+  else
+    {
+      usage();
+    }
+
+  // either way, the rest of the trace has to run on the heap
+  replay(table, split, n_ops);
+  free_pages(page_of(table));
+  kma_page_roots[TABLEROOT] = NULL;
+
+  stat = page_stats();
+  if (stat->num_requested != stat->num_freed || stat->num_in_use != 0)
+    {
+      error("not all pages freed", "");
+    }
+
+  printf("Test: PASS\n");
+  return 0;
+}
+
+mem_t*
+newTable()
+{
+  int pages = (n_req * sizeof(mem_t) + PAGESIZE - 1) / PAGESIZE;
+  kma_page_t* page = get_pages(pages);
+
+  if (page == NULL)
+    {
+      error("trace too large for the request table", "");
+    }
+
+  memset(page->ptr, 0, n_req * sizeof(mem_t));
+  kma_page_roots[TABLEROOT] = page->ptr;
+  return page->ptr;
+}
+
+void
+replay(mem_t* table, int from, int to)
+{
+  mem_t* req;
+  int i;
+
+  for (i = from; i < to && i < n_ops; i++)
+    {
+      req = &table[ops[i].id];
+      if (ops[i].request)
+	{
+	  req->size = ops[i].size;
+	  req->ptr = kma_malloc(req->size);
+	  if (req->ptr != NULL)
+	    memset(req->ptr, ops[i].id, req->size);
+	}
+      else if (req->ptr != NULL)
+	{
+	  if (*(char*) req->ptr != (char) ops[i].id)
+	    error("memory mismatch", "");
+	  kma_free(req->ptr, req->size);
+	  req->ptr = NULL;
+	}
+    }
+}
+
+void
+verify(mem_t* table)
+{
+  int i;
+
+  for (i = 0; i < n_req; i++)
+    {
+      if (table[i].ptr != NULL
+	  && (*(char*) table[i].ptr != (char) i
+	      || ((char*) table[i].ptr)[table[i].size - 1] != (char) i))
+	{
+	  error("memory mismatch after attaching", "");
+	}
+    }
+}
+
+double
+now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void
+usage()
+{
+  printf("Usage: %s rebuild traceFile ops\n"
+	 "       %s save|attach poolFile traceFile ops\n", name, name);
+  exit(0);
+}
+
+void
+error(char* message, char* arg)
+{
+  fprintf(stderr, "ERROR: %s: %s.\n", message, arg);
+  exit(-1);
+}
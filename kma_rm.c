@@ -41,13 +41,14 @@
  
  ***************************************************************************/
 
-#ifdef KMA_RM
+#if defined(KMA_RM) || defined(KMA_BENCH)
 #define __KMA_IMPL__
 
 /************System include***********************************************/
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 /************Private include**********************************************/
 #include "kma_page.h"
@@ -67,52 +68,94 @@ typedef struct block_t
   struct block_t* prev;
 } blockT;
 
+// the first page is kept among the roots of the page pool, so that it
+// comes back with a pool file
+#define FIRSTROOT 0
+#define FIRSTPAGE ((kma_page_t*) kma_page_roots[FIRSTROOT])
+
+// page slot holding the offset from which the page was never written, if
+// it came zeroed from the page layer; blocks are split off the front of
+// free space, so everything past the last header or request is still zero
+#define CLEANSLOT 0
+#define CLEAN(page) ((page)->ptr + (long) (page)->slot[CLEANSLOT])
+
 /************Global Variables*********************************************/
-kma_page_t* firstPage = NULL;
 /************Function Prototypes******************************************/
 
 // gather amount of free memory in block
-int getBlockSize(blockT*);
+static int getBlockSize(blockT*);
 
 // update the status of a block
-void updateBlock(blockT*, blockT*, blockT*, bool);
+static void updateBlock(blockT*, blockT*, blockT*, bool);
 
-// find next free block
-blockT* getNextFree(kma_page_t*, kma_size_t);
+// find next free block, NULL if the page pool ran out
+static blockT* getNextFree(kma_page_t*, kma_size_t);
 
 // get free space after block
-int getFreeSpace(blockT*, blockT*);
+static int getFreeSpace(blockT*, blockT*);
 
 // check if neighbor in given direction is free
-bool isNeighborFree(blockT*, int);
+static bool isNeighborFree(blockT*, int);
 
 // coalesce with neighbors
-void coalesce(blockT*);
+static void coalesce(blockT*);
+
+// requests that can't share a page get a run of whole pages
+#define WHOLEPAGES(size) ((size) + sizeof(blockT) >= PAGESIZE)
+
+// first block of a page, placed at the page's color
+#define FIRSTBLOCK(page) ((blockT*)((page)->ptr + (page)->color))
+
+// set up a new page holding a single free block big enough for size, NULL
+// if the page pool ran out
+static kma_page_t* newPage(kma_size_t);
+
+// kma_rm_malloc(), clearing the memory if asked to
+static void* allocBlock(kma_size_t, bool);
 
 /************External Declaration*****************************************/
 
 /**************Implementation***********************************************/
 
 
-void*
-kma_malloc(kma_size_t size)
+static void*
+kma_rm_malloc(kma_size_t size)
 {
-    if(size > PAGESIZE)
-        return NULL;
+    return allocBlock(size, FALSE);
+}
+
+static void*
+kma_rm_calloc(kma_size_t size)
+{
+    return allocBlock(size, TRUE);
+}
+
+static void*
+allocBlock(kma_size_t size, bool clear)
+{
+    if(WHOLEPAGES(size)){
+        kma_page_t* page = get_pages((size + PAGESIZE - 1) / PAGESIZE);
+        if(page == NULL)
+            return NULL;
+        if(clear && !page->zero)
+            memset(page->ptr, 0, size);
+        return page->ptr;
+    }
     else {
-        if(firstPage == NULL){
+        if(FIRSTPAGE == NULL){
             // Initialize first page with new block
-            firstPage = get_page();
-            *((kma_page_t**)firstPage->ptr) = firstPage;
-            blockT* firstBlock = (blockT*)(firstPage->ptr + sizeof(kma_page_t*));
-
-            // set attributes of new block
-            updateBlock(firstBlock, NULL, NULL, TRUE);
+            kma_page_t* page = newPage(size);
+            if(page == NULL)
+                return NULL;
+            kma_page_roots[FIRSTROOT] = page;
+            updateBlock(FIRSTBLOCK(FIRSTPAGE), NULL, NULL, TRUE);
         }
 
 
         // find next free block, make it unavailable
-        blockT* curBlock = getNextFree(firstPage, size);
+        blockT* curBlock = getNextFree(FIRSTPAGE, size);
+        if(curBlock == NULL)
+            return NULL;
         curBlock->isFree = FALSE;
 
         // set pointer to newBlock
@@ -121,27 +164,40 @@ kma_malloc(kma_size_t size)
         // calculate free remaining space after block (on same page)
         int freeSpace = getFreeSpace(curBlock, newBlock);
 
+        // only what was written before needs clearing
+        kma_page_t* page = page_of(curBlock);
+        void* data = (void*)curBlock + sizeof(*curBlock);
+        void* clean = CLEAN(page);
+        if(clear && data < clean)
+            memset(data, 0, data + size < clean ? size : clean - data);
+
         // if big enough to fit a standard block, insert into linked list
+        void* written = data + size;
         if(freeSpace > sizeof(blockT))
         {
             updateBlock(newBlock, curBlock, curBlock->next, TRUE);
             curBlock->next = newBlock;
             if(newBlock->next != NULL)
                 newBlock->next->prev = newBlock;
+            written = (void*)newBlock + sizeof(blockT);
         }
+        if(written > clean)
+            page->slot[CLEANSLOT] = (void*)(written - page->ptr);
 
 
         // return pointer to allocated memory
-        return (void*)curBlock + sizeof(*curBlock);
+        return data;
     }
 }
 
 
-void
-kma_free(void* ptr, kma_size_t size)
+static void
+kma_rm_free(void* ptr, kma_size_t size)
 {
     if(ptr == NULL)
         return;
+    else if(WHOLEPAGES(size))
+        free_pages(page_of(ptr));
     else{
         blockT* curBlock = (blockT*)(ptr - sizeof(blockT));
 
@@ -149,16 +205,17 @@ kma_free(void* ptr, kma_size_t size)
         coalesce(curBlock);
 
         // Find first block of page
-        blockT* firstBlock = (blockT*)(BASEADDR(curBlock) + sizeof(kma_page_t*));
+        kma_page_t* page = page_of(curBlock);
+        blockT* firstBlock = FIRSTBLOCK(page);
 
         // If page only contains one block
-        if(getBlockSize(firstBlock) >= PAGESIZE - sizeof(*firstBlock) - sizeof(kma_page_t*)){
-            if(firstBlock == (blockT*)(firstPage->ptr + sizeof(kma_page_t*))){
+        if(getBlockSize(firstBlock) >= PAGESIZE - page->color - sizeof(*firstBlock)){
+            if(firstBlock == FIRSTBLOCK(FIRSTPAGE)){
                 // if first page is also last page
                 if(firstBlock->next == NULL)
-                    firstPage = NULL;
+                    kma_page_roots[FIRSTROOT] = NULL;
                 else
-                    firstPage = *((kma_page_t**)BASEADDR(firstBlock->next));
+                    kma_page_roots[FIRSTROOT] = page_of(firstBlock->next);
             }
 
             if(firstBlock->prev != NULL)
@@ -167,12 +224,12 @@ kma_free(void* ptr, kma_size_t size)
             if(firstBlock->next != NULL)
                 firstBlock->next->prev = firstBlock->prev;
 
-            free_page(*((kma_page_t**)BASEADDR(curBlock)));
+            free_page(page);
         }
     }
 }
 
-int getBlockSize(blockT* block){
+static int getBlockSize(blockT* block){
     if (block == NULL)
         return -1;
     else if (block -> next != NULL && BASEADDR(block) ==  BASEADDR(block->next))
@@ -183,15 +240,15 @@ int getBlockSize(blockT* block){
     }
 }
 
-void updateBlock(blockT* block, blockT* newPrev, blockT* newNext, bool newBool){
+static void updateBlock(blockT* block, blockT* newPrev, blockT* newNext, bool newBool){
     block->prev = newPrev;
     block->next = newNext;
     block->isFree = newBool;
 }
 
-blockT* getNextFree(kma_page_t* firstPage, kma_size_t size){
+static blockT* getNextFree(kma_page_t* firstPage, kma_size_t size){
         // get pointer to next block start
-        blockT* nextBlock = (blockT*)(firstPage->ptr + sizeof(kma_page_t*));
+        blockT* nextBlock = FIRSTBLOCK(firstPage);
 
         // iterate until we find a block that is fre and can contain this size
         while(!(nextBlock->isFree && size < getBlockSize(nextBlock))){
@@ -199,9 +256,10 @@ blockT* getNextFree(kma_page_t* firstPage, kma_size_t size){
             if(nextBlock->next == NULL)
             {
                 // allocate new page and new first block
-                kma_page_t* nextPage = get_page();
-                *((kma_page_t**)nextPage->ptr) = nextPage;
-                blockT* nextFirstBlock = (blockT*)(nextPage->ptr + sizeof(kma_page_t*));
+                kma_page_t* nextPage = newPage(size);
+                if(nextPage == NULL)
+                    return NULL;
+                blockT* nextFirstBlock = FIRSTBLOCK(nextPage);
                 nextBlock->next = nextFirstBlock;
 
                 // set attributes of iterating block
@@ -212,7 +270,21 @@ blockT* getNextFree(kma_page_t* firstPage, kma_size_t size){
         return nextBlock;
 }
 
-int getFreeSpace(blockT* curBlock, blockT* newBlock){
+static kma_page_t* newPage(kma_size_t size){
+    kma_page_t* page = get_page();
+    if(page == NULL)
+        return NULL;
+
+    // large requests don't leave room for coloring the page
+    if(size + sizeof(blockT) + page->color >= PAGESIZE)
+        page->color = 0;
+
+    // the first block's header is all that is written so far
+    page->slot[CLEANSLOT] = (void*)(page->zero ? page->color + sizeof(blockT) : PAGESIZE);
+    return page;
+}
+
+static int getFreeSpace(blockT* curBlock, blockT* newBlock){
     if(curBlock->next != NULL && BASEADDR(curBlock)==BASEADDR(curBlock->next))
         // free space is space between next block and end of new block
         return (void*)(curBlock->next) - (void*)newBlock;
@@ -221,7 +293,7 @@ int getFreeSpace(blockT* curBlock, blockT* newBlock){
         return BASEADDR(curBlock) + PAGESIZE - (void*)newBlock;
 }
 
-bool isNeighborFree(blockT* curBlock, int direction){
+static bool isNeighborFree(blockT* curBlock, int direction){
     blockT* neighbor;
     // get neighbor
     if (direction == 1)
@@ -239,7 +311,7 @@ bool isNeighborFree(blockT* curBlock, int direction){
     return TRUE;
 }
 
-void coalesce(blockT* curBlock){
+static void coalesce(blockT* curBlock){
 
     // if both neighbors are free
     if (isNeighborFree(curBlock, 0) && isNeighborFree(curBlock, 1)) {
@@ -269,4 +341,41 @@ void coalesce(blockT* curBlock){
 
 }
 
+static void kma_rm_stats(kma_stat_t* stat){
+    stat->num_pages = 0;
+    stat->num_spare = 0;
+
+    // the blocks are listed page by page, count where a page starts
+    blockT* block = FIRSTPAGE == NULL ? NULL : FIRSTBLOCK(FIRSTPAGE);
+    for(; block != NULL; block = block->next)
+        if(block->prev == NULL || BASEADDR(block) != BASEADDR(block->prev))
+            stat->num_pages++;
+}
+
+kma_ops_t kma_rm_ops =
+{
+    "KMA_RM", NULL, kma_rm_malloc, kma_rm_calloc, kma_rm_free, NULL,
+    kma_rm_stats
+};
+
+#ifdef KMA_RM
+void*
+kma_malloc(kma_size_t size)
+{
+    return kma_rm_malloc(size);
+}
+
+void*
+kma_calloc(kma_size_t size)
+{
+    return kma_rm_calloc(size);
+}
+
+void
+kma_free(void* ptr, kma_size_t size)
+{
+    kma_rm_free(ptr, size);
+}
+#endif
+
 #endif // KMA_RM
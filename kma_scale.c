@@ -0,0 +1,403 @@
+/***************************************************************************
+ *  Title: Kernel Page Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Multi-threaded scaling benchmark for the page allocator
+ ***************************************************************************/
+
+/************************************************************************
+ Project Group: abg341, zta515
+
+ ***************************************************************************/
+
+#define _GNU_SOURCE
+
+/************System include***********************************************/
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+// pages each thread keeps allocated while it churns
+#define LIVEPAGES 64
+
+// atomic gets each thread makes once the pool has run out
+#define ATOMICPAGES 16
+
+/************Global Variables*********************************************/
+static int ops = 0;
+static pthread_barrier_t start;
+static pthread_barrier_t starved;
+// pin the threads to CPUs and take pages from their own node or, with
+// remote, from the next one
+static bool pinned = FALSE;
+static bool remote = FALSE;
+// give every thread a pool of its own, with a quota of LIVEPAGES
+static bool pools = FALSE;
+// run the pool dry and time atomic gets instead of churning
+static bool reserve = FALSE;
+static int cap = 0;
+static int atomicFailed = 0;
+static double atomicMax = 0.0;
+static double atomicSum = 0.0;
+static pthread_mutex_t atomicLock = PTHREAD_MUTEX_INITIALIZER;
+// when the first thread started to churn and the last one was done, which
+// bound the run even if a thread got going before the others
+static double churnBegin = 0.0;
+static double churnEnd = 0.0;
+static pthread_mutex_t churnLock = PTHREAD_MUTEX_INITIALIZER;
+
+/************Function Prototypes******************************************/
+void mixPools();
+void* churn(void*);
+void* starve(void*);
+kma_page_t* getPage(int, int);
+double now();
+void usage();
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+char *name = NULL;
+
+int
+main(int argc, char* argv[])
+{
+  pthread_t* threads;
+  int n_threads, i;
+  kma_page_stat_t* stat;
+
+  name = argv[0];
+
+  if (argc != 3 && argc != 4)
+    {
+      usage();
+    }
+  
+  if (argc == 4 && strcmp(argv[3], "pool") == 0)
+    {
+      pools = TRUE;
+    }
+  else if (argc == 4 && strcmp(argv[3], "reserve") == 0)
+    {
+      reserve = TRUE;
+    }
+  else if (argc == 4)
+    {
+      pinned = TRUE;
+      if (strcmp(argv[3], "remote") == 0)
+	remote = TRUE;
+      else if (strcmp(argv[3], "local") != 0)
+	usage();
+    }
+
+  n_threads = atoi(argv[1]);
+  ops = atoi(argv[2]);
+  if (n_threads < 1 || ops < 1)
+    {
+      usage();
+    }
+
+  if (pools)
+    {
+      mixPools();
+    }
+
+  threads = malloc(n_threads * sizeof(pthread_t));
+  pthread_barrier_init(&start, NULL, n_threads + 1);
+  pthread_barrier_init(&starved, NULL, n_threads);
+
+  if (reserve)
+    {
+      // the reserve holds the atomic gets of all threads, everything else
+      // under the cap is for the threads to run dry
+      page_reserve(n_threads * ATOMICPAGES);
+      cap = n_threads * (LIVEPAGES + ATOMICPAGES);
+      page_cap(cap);
+    }
+
+  for (i = 0; i < n_threads; i++)
+    {
+      pthread_create(&threads[i], NULL, reserve ? starve : churn,
+		     (void*) (long) i);
+    }
+
+  pthread_barrier_wait(&start);
+  for (i = 0; i < n_threads; i++)
+    {
+      pthread_join(threads[i], NULL);
+    }
+
+  stat = page_stats();
+  if (stat->num_requested != stat->num_freed || stat->num_in_use != 0)
+    {
+      error("not all pages freed", "");
+    }
+
+  if (reserve)
+    {
+      printf("%d threads: %d atomic gets with the pool run dry, %d failed, "
+	     "%.0f ns average, %.0f ns max\n", n_threads,
+	     n_threads * ATOMICPAGES, atomicFailed,
+	     atomicSum / (n_threads * ATOMICPAGES) * 1e9, atomicMax * 1e9);
+      printf("  %d pages from the reserve", stat->num_from_reserve);
+      
+      // the pool went idle and gave the reserve back, the next page
+      // operation fills it again
+      kma_page_t* page = get_page();
+      stat = page_stats();
+      printf(", refilled to %d\n", stat->num_reserve);
+      free_page(page);
+      if (atomicFailed > 0 || stat->num_reserve != n_threads * ATOMICPAGES)
+	{
+	  error("the reserve didn't hold", "");
+	}
+      free(threads);
+      return 0;
+    }
+
+  // one get and one free per operation
+  printf("%d threads: %.0f page ops/sec\n", n_threads,
+	 2.0 * ops * n_threads / (churnEnd - churnBegin));
+  
+  if (page_nodes(-1) > 1)
+    {
+      for (i = 0; i < page_nodes(-1); i++)
+	{
+	  kma_node_stat_t* node = page_node_stats(i);
+	  
+	  printf("  node %d: %d pages local, %d stolen\n", i,
+		 node->num_local, node->num_stolen);
+	}
+    }
+
+  free(threads);
+  return 0;
+}
+
+// allocators sharing the process but not a pool: running one pool out
+// must only run the shrinkers of that pool, which know its roots
+void
+mixPools()
+{
+  kma_pool_t* a = page_pool_create(3);
+  kma_pool_t* b = page_pool_create(2);
+  kma_page_stat_t* stat;
+  void* keep;
+  void* spare;
+  void* more;
+  void* small;
+  void* big[4];
+  int i;
+
+  // P2FL in a: its table page, a page of blocks it keeps using and an
+  // empty one it keeps as a spare, which fills the quota
+  page_pool_enter(a);
+  keep = kma_p2fl_ops.malloc(300);
+  spare = kma_p2fl_ops.malloc(100);
+  kma_p2fl_ops.free(spare, 100);
+
+  // RM in b, with a root of its own, runs b out; P2FL's shrinker must
+  // not be run on b's roots
+  page_pool_enter(b);
+  small = kma_rm_ops.malloc(100);
+  for (i = 0; i < 4; i++)
+    {
+      big[i] = kma_rm_ops.malloc(2 * PAGESIZE - 8);
+    }
+  stat = page_pool_stats(b);
+  if (big[0] != NULL || stat->num_failed != 4 || stat->num_reclaimed != 0)
+    {
+      error("a shrinker ran on a pool it wasn't registered with", "");
+    }
+  kma_rm_ops.free(small, 100);
+
+  // a running out gives P2FL's spare back for another size
+  page_pool_enter(a);
+  more = kma_p2fl_ops.malloc(1000);
+  stat = page_pool_stats(a);
+  if (more == NULL || stat->num_reclaimed != 1)
+    {
+      error("the pool's own shrinker didn't run", "");
+    }
+  kma_p2fl_ops.free(more, 1000);
+  kma_p2fl_ops.free(keep, 300);
+  page_pool_enter(NULL);
+
+  if (!page_pool_destroy(a) || !page_pool_destroy(b))
+    {
+      error("pages left in the mixed pools", "");
+    }
+}
+
+void*
+churn(void* arg)
+{
+  kma_page_t* pages[LIVEPAGES];
+  unsigned int seed = (long) arg;
+  int nodes = page_nodes(-1);
+  kma_pool_t* p = NULL;
+  kma_page_stat_t* stat;
+  double begin, end;
+  int i, j;
+  
+  if (pinned)
+    {
+      // emulated nodes get the CPUs round robin, so thread i runs on
+      // node i % nodes as long as there are enough CPUs
+      cpu_set_t cpus;
+      
+      CPU_ZERO(&cpus);
+      CPU_SET((long) arg % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+      pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+
+  if (pools)
+    {
+      p = page_pool_create(LIVEPAGES);
+      page_pool_enter(p);
+    }
+
+  for (i = 0; i < LIVEPAGES; i++)
+    {
+      pages[i] = getPage((long) arg, nodes);
+    }
+
+  if (pools && get_page() != NULL)
+    {
+      error("got a page beyond the quota", "");
+    }
+
+  pthread_barrier_wait(&start);
+
+  // with more threads than CPUs, a thread may be well into its loop
+  // before the main thread even gets to run, so each one times itself
+  begin = now();
+  for (i = 0; i < ops; i++)
+    {
+      j = rand_r(&seed) % LIVEPAGES;
+      free_page(pages[j]);
+      pages[j] = getPage((long) arg, nodes);
+      *((int*) pages[j]->ptr) = i;
+    }
+  end = now();
+
+  pthread_mutex_lock(&churnLock);
+  if (churnBegin == 0.0 || begin < churnBegin)
+    churnBegin = begin;
+  churnEnd = end > churnEnd ? end : churnEnd;
+  pthread_mutex_unlock(&churnLock);
+
+  for (i = 0; i < LIVEPAGES; i++)
+    {
+      free_page(pages[i]);
+    }
+
+  if (pools)
+    {
+      stat = page_pool_stats(p);
+      if (stat->num_requested != stat->num_freed || stat->num_failed != 1)
+	error("pool statistics don't add up", "");
+      if (!page_pool_destroy(p))
+	error("unable to destroy the pool", "");
+    }
+
+  return NULL;
+}
+
+void*
+starve(void* arg)
+{
+  kma_page_t** pages = malloc(cap * sizeof(kma_page_t*));
+  kma_page_t* atomic[ATOMICPAGES];
+  double begin, took, max = 0.0, sum = 0.0;
+  int n = 0, failed = 0, i;
+
+  // once a get fails, the shrinkers have been run and this thread's
+  // cache is empty, so the other pages under the cap are in use
+  while ((pages[n] = get_page()) != NULL)
+    {
+      n++;
+    }
+
+  pthread_barrier_wait(&start);
+
+  for (i = 0; i < ATOMICPAGES; i++)
+    {
+      begin = now();
+      atomic[i] = get_page_atomic();
+      took = now() - begin;
+      sum += took;
+      max = took > max ? took : max;
+      if (atomic[i] == NULL)
+	failed++;
+      else
+	*((int*) atomic[i]->ptr) = i;
+    }
+
+  // nothing is freed before every thread is done
+  pthread_barrier_wait(&starved);
+
+  for (i = 0; i < ATOMICPAGES; i++)
+    {
+      if (atomic[i] != NULL)
+	free_page(atomic[i]);
+    }
+  for (i = 0; i < n; i++)
+    {
+      free_page(pages[i]);
+    }
+  free(pages);
+
+  pthread_mutex_lock(&atomicLock);
+  atomicFailed += failed;
+  atomicSum += sum;
+  atomicMax = max > atomicMax ? max : atomicMax;
+  pthread_mutex_unlock(&atomicLock);
+
+  return NULL;
+}
+
+kma_page_t*
+getPage(int thread, int nodes)
+{
+  return remote ? get_page_node((thread + 1) % nodes) : get_page();
+}
+
+double
+now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void
+usage()
+{
+  printf("Usage: %s threads opsPerThread [local|remote|pool|reserve]\n", name);
+  exit(0);
+}
+
+void
+error(char* message, char* arg)
+{
+  fprintf(stderr, "ERROR: %s: %s.\n", message, arg);
+  exit(-1);
+}
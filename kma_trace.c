@@ -0,0 +1,144 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Trace loader: maps a trace file and decodes it up front
+ ***************************************************************************/
+
+/************************************************************************
+ Project Group: abg341, zta515
+
+ ***************************************************************************/
+
+#define __KTRACE_IMPL__
+
+/************System include***********************************************/
+#include <assert.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/************Private include**********************************************/
+#include "kma_trace.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+/************Global Variables*********************************************/
+
+/************Function Prototypes******************************************/
+// read a decimal integer, skipping white space first; FALSE if there is
+// none
+static bool scanInt(char**, char*, int*);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+kma_op_t*
+trace_load(char* file, int* n_req, int* n_ops)
+{
+  struct stat st;
+  char *trace, *p, *end, *word;
+  char command[16];
+  kma_op_t* ops;
+  int fd, size = 1024, n = 0;
+  
+  fd = open(file, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) < 0)
+    {
+      error("unable to open input test file", file);
+    }
+  
+  trace = st.st_size > 0 ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+				fd, 0) : MAP_FAILED;
+  close(fd);
+  if (trace == MAP_FAILED)
+    {
+      error("Couldn't read number of requests at head of file", "");
+    }
+  madvise(trace, st.st_size, MADV_SEQUENTIAL);
+  p = trace;
+  end = trace + st.st_size;
+  
+  // Get the number of requests in the trace file
+  if (!scanInt(&p, end, n_req))
+    error("Couldn't read number of requests at head of file", "");
+  
+  ops = malloc(size * sizeof(kma_op_t));
+  for (;;)
+    {
+      while (p < end && isspace((unsigned char) *p))
+	p++;
+      if (p == end)
+	break;
+      word = p;
+      while (p < end && !isspace((unsigned char) *p))
+	p++;
+      
+      if (n == size)
+	{
+	  size *= 2;
+	  ops = realloc(ops, size * sizeof(kma_op_t));
+	}
+      
+      ops[n].request = p - word == 7 && memcmp(word, "REQUEST", 7) == 0;
+      if (ops[n].request)
+	{
+	  if (!scanInt(&p, end, &ops[n].id)
+	      || !scanInt(&p, end, &ops[n].size))
+	    error("Not enough arguments to REQUEST", "");
+	}
+      else if (p - word == 4 && memcmp(word, "FREE", 4) == 0)
+	{
+	  if (!scanInt(&p, end, &ops[n].id))
+	    error("Not enough arguments to FREE", "");
+	}
+      else
+	{
+	  snprintf(command, sizeof(command), "%.*s", (int) (p - word), word);
+	  error("unknown command type:", command);
+	}
+      
+      assert(ops[n].id >= 0 && ops[n].id < *n_req);
+      n++;
+    }
+  
+  munmap(trace, st.st_size);
+  *n_ops = n;
+  return ops;
+}
+
+static bool
+scanInt(char** pp, char* end, int* value)
+{
+  char* p = *pp;
+  bool negative = FALSE;
+  int res = 0;
+  
+  while (p < end && isspace((unsigned char) *p))
+    p++;
+  if (p < end && *p == '-')
+    {
+      negative = TRUE;
+      p++;
+    }
+  if (p == end || !isdigit((unsigned char) *p))
+    return FALSE;
+  
+  while (p < end && isdigit((unsigned char) *p))
+    res = res * 10 + (*p++ - '0');
+  
+  *value = negative ? -res : res;
+  *pp = p;
+  return TRUE;
+}
+
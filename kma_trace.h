@@ -0,0 +1,63 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Interface for loading the trace files the allocators are
+ *             replayed on
+ ***************************************************************************/
+
+/************************************************************************
+ Project Group: abg341, zta515
+
+ ***************************************************************************/
+
+#ifndef __KTRACE_H__
+#define __KTRACE_H__
+
+/************System include***********************************************/
+
+/************Private include**********************************************/
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+#undef EXTERN
+#ifdef __KTRACE_IMPL__
+#define EXTERN
+#else
+#define EXTERN extern
+#endif
+
+// a trace operation, decoded before the replay
+typedef struct
+{
+  bool request; // REQUEST or FREE
+  int id;
+  int size;
+} kma_op_t;
+
+/************Global Variables*********************************************/
+
+/************Function Prototypes******************************************/
+
+/***********************************************************************
+ *  Title: Loads a trace
+ * ---------------------------------------------------------------------
+ *    Purpose: Map a trace file and decode all of its operations, so
+ *             that a replay doesn't pay for parsing it; a malformed trace
+ *             is an error()
+ *    Input: the trace file, where to store the number of requests and
+ *           the number of operations
+ *    Output: the operations, to be freed with free()
+ ***********************************************************************/
+EXTERN kma_op_t* trace_load(char* file, int* n_req, int* n_ops);
+
+/************External Declaration*****************************************/
+
+/**************Definition***************************************************/
+
+#endif /* __KTRACE_H__ */